@@ -0,0 +1,67 @@
+#include <immintrin.h>
+#include <limits.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "barrier.h"
+
+static inline
+void futex_wait(SDL_atomic_t* word, int value) {
+#ifdef __linux__
+	syscall(SYS_futex, &word->value, FUTEX_WAIT_PRIVATE, value, NULL,
+	        NULL, 0);
+#else
+	(void) word;
+	(void) value;
+	sched_yield();
+#endif
+}
+
+static inline
+void futex_wake_all(SDL_atomic_t* word) {
+#ifdef __linux__
+	syscall(SYS_futex, &word->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+	        NULL, 0);
+#else
+	(void) word;
+#endif
+}
+
+void barrier_init(struct barrier* barrier, int threads) {
+	SDL_AtomicSet(&barrier->count, threads);
+	SDL_AtomicSet(&barrier->sense, 0);
+	SDL_AtomicSet(&barrier->sleepers, 0);
+	barrier->threads = threads;
+	/* With one CPU the thread we wait for can't run while we spin */
+	barrier->spins = SDL_GetCPUCount() > 1 ? BARRIER_SPINS : 0;
+}
+
+void barrier_wait(struct barrier* barrier) {
+	/* Can't flip before this thread arrives */
+	int sense = SDL_AtomicGet(&barrier->sense);
+
+	if (SDL_AtomicAdd(&barrier->count, -1) == 1) {
+		SDL_AtomicSet(&barrier->count, barrier->threads);
+		SDL_AtomicSet(&barrier->sense, !sense);
+		/* Sleepers count themselves before they look at the sense */
+		if (SDL_AtomicGet(&barrier->sleepers))
+			futex_wake_all(&barrier->sense);
+		return;
+	}
+
+	for (int i = 0; i < barrier->spins; i++) {
+		if (SDL_AtomicGet(&barrier->sense) != sense)
+			return;
+		_mm_pause();
+	}
+
+	SDL_AtomicIncRef(&barrier->sleepers);
+	while (SDL_AtomicGet(&barrier->sense) == sense)
+		futex_wait(&barrier->sense, sense);
+	SDL_AtomicDecRef(&barrier->sleepers);
+}
@@ -0,0 +1,26 @@
+#ifndef __BARRIER_H__
+#define __BARRIER_H__
+#include <SDL.h>
+
+/* Polls of the sense before sleeping, some tens of microseconds */
+#define BARRIER_SPINS 2048
+
+/* Sense-reversing barrier: threads read the sense as they arrive, the last
+ * one to arrive resets the count and flips it, the rest wait for it to
+ * change. They spin for a while first, since the others are usually close
+ * behind, and then sleep on a futex that the last thread wakes with a single
+ * broadcast (only when someone did go to sleep). No locks and no syscalls
+ * when the threads arrive together. */
+struct barrier {
+	SDL_atomic_t	count;		/* Still to arrive this round */
+	SDL_atomic_t	sense;		/* Flipped at the end of each round */
+	SDL_atomic_t	sleepers;	/* On the futex */
+	int		threads;	/* Taking part */
+	int		spins;		/* None on a single CPU */
+};
+
+void barrier_init(struct barrier* barrier, int threads);
+/* Returns once all the threads have called it */
+void barrier_wait(struct barrier* barrier);
+
+#endif /* __BARRIER_H__ */
@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
+
+#include "barrier.h"
+#include "vec.h"
+#include "vecx.h"
+
+/* Microbenchmarks: make bench. Times in nanoseconds, for the SIMD headers
+ * the best of a few repetitions so a preemption doesn't count. */
+
+#define REPEATS 5
+#define VECTORS 4096	/* Fits in L1 with the results */
+#define PASSES 256	/* Over the VECTORS of each repetition */
+#define BARRIER_ROUNDS 20000
+#define BARRIER_THREADS 16	/* Most taking part, the main one included */
+
+/* Inputs and results, the results summed at the end so nothing goes away.
+ * The same vectors as v3 and already in lanes, as packet code keeps them. */
+static v3 in_a[VECTORS];
+static v3 in_b[VECTORS];
+static v3x4 in4_a[VECTORS / 4];
+static v3x4 in4_b[VECTORS / 4];
+static v3x8 in8_a[VECTORS / 8];
+static v3x8 in8_b[VECTORS / 8];
+static float in_key[VECTORS];
+static v3 out[VECTORS];
+static v3x4 out4[VECTORS / 4];
+static v3x8 out8[VECTORS / 8];
+static float out_f[VECTORS];
+static volatile float sink;
+
+static
+void bench_init(void) {
+	srand(1);
+	for (size_t i = 0; i < VECTORS; i++) {
+		in_a[i] = (v3){ rand() / (float) RAND_MAX - .5f,
+		                rand() / (float) RAND_MAX - .5f,
+		                rand() / (float) RAND_MAX + .1f };
+		in_b[i] = (v3){ rand() / (float) RAND_MAX,
+		                rand() / (float) RAND_MAX - .5f,
+		                rand() / (float) RAND_MAX };
+		in_key[i] = rand() / (float) RAND_MAX;
+	}
+	for (size_t i = 0; i < VECTORS / 4; i++) {
+		in4_a[i] = v3x4load(in_a + i * 4);
+		in4_b[i] = v3x4load(in_b + i * 4);
+	}
+	for (size_t i = 0; i < VECTORS / 8; i++) {
+		in8_a[i] = v3x8load(in_a + i * 8, 8);
+		in8_b[i] = v3x8load(in_b + i * 8, 8);
+	}
+}
+
+static
+void bench_sink(void) {
+	float sum = 0.f;
+
+	for (size_t i = 0; i < VECTORS; i++) {
+		v3 o4 = v3x4lane(out4[i / 4], i % 4);
+		v3 o8 = v3x8lane(out8[i / 8], i % 8);
+		sum += out[i].x + out[i].y + out[i].z + out_f[i];
+		sum += o4.x + o4.y + o4.z + o8.x + o8.y + o8.z;
+	}
+	sink = sum;
+}
+
+/* Goes over the VECTORS once */
+typedef void kernel(void);
+
+/* ns per vector of a kernel */
+static
+double bench(kernel* k) {
+	double best = INFINITY;
+
+	for (int r = 0; r < REPEATS; r++) {
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int pass = 0; pass < PASSES; pass++)
+			k();
+		double ns = (SDL_GetPerformanceCounter() - start) * 1e9
+		            / SDL_GetPerformanceFrequency();
+		best = ns < best ? ns : best;
+	}
+	bench_sink();
+	return best / ((double) PASSES * VECTORS);
+}
+
+/* The kernels of an operation through vec.h, v3x4 and v3x8. Each one sets
+ * r from a and b. */
+#define KERNELS(name, scalar, x4, x8) \
+static void name##_vec(void) { \
+	for (size_t i = 0; i < VECTORS; i++) { \
+		v3 a = in_a[i], b = in_b[i], r; \
+		(void) b; \
+		scalar; \
+		out[i] = r; \
+	} \
+} \
+static void name##_x4(void) { \
+	for (size_t i = 0; i < VECTORS / 4; i++) { \
+		v3x4 a = in4_a[i], b = in4_b[i], r; \
+		(void) a; (void) b; \
+		x4; \
+		out4[i] = r; \
+	} \
+} \
+static void name##_x8(void) { \
+	for (size_t i = 0; i < VECTORS / 8; i++) { \
+		v3x8 a = in8_a[i], b = in8_b[i], r; \
+		(void) a; (void) b; \
+		x8; \
+		out8[i] = r; \
+	} \
+}
+
+/* From v3 into lanes, what packet code pays to start from vec.h */
+KERNELS(load, r = a, r = v3x4load(in_a + i * 4), r = v3x8load(in_a + i * 8, 8))
+KERNELS(add, r = v3add(a, b), r = v3x4add(a, b), r = v3x8add(a, b))
+KERNELS(dot, r = v3fill(v3dot(a, b)),
+        r = a; r.x = v3x4dot(a, b),
+        r = a; r.x = v3x8dot(a, b))
+KERNELS(cross, r = v3cross(a, b), r = v3x4cross(a, b), r = v3x8cross(a, b))
+KERNELS(normalize, r = v3normalize(a), r = v3x4normalize(a),
+        r = v3x8normalize(a))
+KERNELS(normalize_fast, r = v3normalize(a), r = v3x4normalize_fast(a),
+        r = v3x8normalize_fast(a))
+
+/* Smallest of each group of 4 or 8 keys */
+static
+void argmin4_scalar(void) {
+	for (size_t i = 0; i < VECTORS; i += 4) {
+		int m = 0;
+		for (int l = 1; l < 4; l++)
+			m = in_key[i + l] < in_key[i + m] ? l : m;
+		out_f[i] = m;
+	}
+}
+
+static
+void argmin4_vec(void) {
+	for (size_t i = 0; i < VECTORS; i += 4)
+		out_f[i] = argmin4(_mm_loadu_ps(in_key + i));
+}
+
+static
+void argmin8_scalar(void) {
+	for (size_t i = 0; i < VECTORS; i += 8) {
+		int m = 0;
+		for (int l = 1; l < 8; l++)
+			m = in_key[i + l] < in_key[i + m] ? l : m;
+		out_f[i] = m;
+	}
+}
+
+static
+void argmin8_vec(void) {
+	for (size_t i = 0; i < VECTORS; i += 8)
+		out_f[i] = argmin8(_mm256_loadu_ps(in_key + i));
+}
+
+static
+void bench_vecx(void) {
+	static const struct {
+		const char*	name;
+		kernel*		k[3];
+	} ops[] = {
+		{ "load", { load_vec, load_x4, load_x8 } },
+		{ "add", { add_vec, add_x4, add_x8 } },
+		{ "dot", { dot_vec, dot_x4, dot_x8 } },
+		{ "cross", { cross_vec, cross_x4, cross_x8 } },
+		{ "normalize", { normalize_vec, normalize_x4,
+		                 normalize_x8 } },
+		{ "normalize_fast", { normalize_fast_vec, normalize_fast_x4,
+		                      normalize_fast_x8 } },
+	};
+
+	printf("ns per v3        %8s %8s %8s\n", "vec.h", "v3x4", "v3x8");
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		printf("%-16s %8.2f %8.2f %8.2f\n", ops[i].name,
+		       bench(ops[i].k[0]), bench(ops[i].k[1]),
+		       bench(ops[i].k[2]));
+
+	printf("ns per group     %8s %8s\n", "scalar", "argmin");
+	printf("%-16s %8.2f %8.2f\n", "of 4", bench(argmin4_scalar) * 4,
+	       bench(argmin4_vec) * 4);
+	printf("%-16s %8.2f %8.2f\n", "of 8", bench(argmin8_scalar) * 8,
+	       bench(argmin8_vec) * 8);
+}
+
+/*
+ * barrier_wait round trips
+ */
+
+static struct barrier bench_barrier;
+
+static
+int barrier_thread(void* data) {
+	(void) data;
+	for (int i = 0; i < BARRIER_ROUNDS; i++)
+		barrier_wait(&bench_barrier);
+	return 0;
+}
+
+/* ns per round with threads taking part, spinning for spins polls first */
+static
+double bench_barrier_round(int threads, int spins) {
+	SDL_Thread* workers[BARRIER_THREADS];
+
+	barrier_init(&bench_barrier, threads);
+	bench_barrier.spins = spins;
+	for (int i = 0; i < threads - 1; i++)
+		workers[i] = SDL_CreateThread(barrier_thread, "bench", NULL);
+
+	/* All of them running before the clock starts */
+	barrier_wait(&bench_barrier);
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int i = 1; i < BARRIER_ROUNDS; i++)
+		barrier_wait(&bench_barrier);
+	double ns = (SDL_GetPerformanceCounter() - start) * 1e9
+	            / SDL_GetPerformanceFrequency();
+
+	for (int i = 0; i < threads - 1; i++)
+		SDL_WaitThread(workers[i], NULL);
+	return ns / (BARRIER_ROUNDS - 1);
+}
+
+/* Spinning is forced even on one CPU, where barrier_init leaves it out: then
+ * every round costs the spins of all but the last thread */
+static
+void bench_barrier_rounds(void) {
+	printf("barrier, %d CPUs\n", SDL_GetCPUCount());
+	printf("ns per round     %8s %8s\n", "spin", "futex");
+	for (int threads = 2; threads <= BARRIER_THREADS; threads *= 2) {
+		double spin = bench_barrier_round(threads, BARRIER_SPINS);
+		double sleep = bench_barrier_round(threads, 0);
+		printf("%2d threads       %8.0f %8.0f\n", threads, spin,
+		       sleep);
+	}
+}
+
+int main(void) {
+	bench_init();
+	bench_vecx();
+	bench_barrier_rounds();
+	return 0;
+}
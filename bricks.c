@@ -0,0 +1,328 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
+
+#include "bricks.h"
+#include "sdf.h"
+
+#define BRICKS_MAGIC	"LOLBRICK"
+#define BRICKS_VERSION	1
+
+/* Coarse cells take at most this share of the memory budget */
+#define CELLS_SHARE	8
+
+/* Distance to the bounded objects only, planes are left for the renderer.
+ * Steps are scaled by each Lipschitz bound so the samples stay 1-Lipschitz */
+static inline
+float bounded_dist(const struct scene* scene, const bool* bounded, v3 p) {
+	float rval = INFINITY;
+	size_t idx = 0;
+
+	vector_foreach(struct object, scene->objects, obj)
+		if (bounded[idx++])
+			rval = minf(rval, get_obj_step(obj, p));
+
+	return rval;
+}
+
+struct build_job {
+	const struct scene*	scene;
+	const bool*		bounded;
+	struct brick_map*	map;
+	const int32_t*		brick_cells;	/* Per brick */
+	SDL_atomic_t		next;
+	int			phase;
+};
+
+static inline
+v3 cell_corner(const struct brick_map* map, size_t cell) {
+	size_t cx = cell % map->dims[0];
+	size_t cy = cell / map->dims[0] % map->dims[1];
+	size_t cz = cell / map->dims[0] / map->dims[1];
+	return v3add(map->origin,
+	             v3scale((v3) {cx, cy, cz}, map->cell_size));
+}
+
+static
+int build_thread(void* ptr) {
+	struct build_job* job = ptr;
+	struct brick_map* map = job->map;
+	const int res = map->res;
+	const float spacing = bricks_spacing(map);
+	const size_t slice = (size_t) map->dims[0] * map->dims[1];
+	int i;
+
+	/* Work is handed out by z-slices of cells or whole bricks */
+	if (job->phase == 0)
+	while ((i = SDL_AtomicAdd(&job->next, 1)) < map->dims[2]) {
+		for (size_t cell = i * slice; cell < (i + 1) * slice; cell++) {
+			v3 center = v3add(cell_corner(map, cell),
+			                  v3fill(map->cell_size / 2.f));
+			map->cells[cell] = bounded_dist(job->scene,
+			                                job->bounded, center);
+		}
+	}
+	else
+	while ((i = SDL_AtomicAdd(&job->next, 1)) < map->num_bricks) {
+		v3 corner = cell_corner(map, job->brick_cells[i]);
+		float* s = map->samples + (size_t) i * res * res * res;
+		for (int z = 0; z < res; z++)
+		for (int y = 0; y < res; y++)
+		for (int x = 0; x < res; x++) {
+			v3 offset = v3scale((v3) {x, y, z}, spacing);
+			v3 p = v3add(corner, offset);
+			*s++ = bounded_dist(job->scene, job->bounded, p);
+		}
+	}
+
+	return 0;
+}
+
+static
+void run_phase(struct build_job* job, int phase, size_t num_threads) {
+	SDL_Thread** threads = malloc(sizeof(SDL_Thread*) * num_threads);
+
+	job->phase = phase;
+	SDL_AtomicSet(&job->next, 0);
+	for (size_t i = 0; i < num_threads; i++)
+		threads[i] = SDL_CreateThread(build_thread, "bricks", job);
+	for (size_t i = 0; i < num_threads; i++)
+		SDL_WaitThread(threads[i], NULL);
+
+	free(threads);
+}
+
+static
+struct brick_map* bricks_build(const struct scene* scene,
+	const bool* bounded, size_t budget, int res, size_t num_threads) {
+	struct brick_map* map = calloc(1, sizeof(struct brick_map));
+	struct build_job job = {scene, bounded, map};
+	v3 lo = v3fill(INFINITY);
+	v3 hi = v3fill(-INFINITY);
+	size_t idx = 0;
+
+	vector_foreach(struct object, scene->objects, obj) {
+		struct bounds b = object_bounds(obj);
+		if (!bounded[idx++])
+			continue;
+		v3 b_lo = v3sub(b.center, v3fill(b.radius));
+		v3 b_hi = v3add(b.center, v3fill(b.radius));
+		lo = (v3) {.vec = _mm_min_ps(lo.vec, b_lo.vec)};
+		hi = (v3) {.vec = _mm_max_ps(hi.vec, b_hi.vec)};
+	}
+
+	/* Size the cells for their share of the budget, a float and an index
+	 * per cell */
+	v3 extent = v3sub(hi, lo);
+	float volume = extent.x * extent.y * extent.z;
+	size_t max_cells = budget / CELLS_SHARE / (sizeof(float)
+	                                           + sizeof(int32_t));
+	map->cell_size = cbrtf(volume / max_cells);
+	map->res = res;
+
+	/* Pad the region so the band around the surfaces fits in */
+	v3 pad = v3fill(map->cell_size);
+	map->origin = v3sub(lo, pad);
+	extent = v3add(extent, v3scale(pad, 2.f));
+	map->dims[0] = ceilf(extent.x / map->cell_size);
+	map->dims[1] = ceilf(extent.y / map->cell_size);
+	map->dims[2] = ceilf(extent.z / map->cell_size);
+
+	size_t num_cells = (size_t) map->dims[0] * map->dims[1] * map->dims[2];
+	map->cells = malloc(sizeof(float) * num_cells);
+	map->brick = malloc(sizeof(int32_t) * num_cells);
+	run_phase(&job, 0, num_threads);
+
+	/* Cells that may hold a surface get a brick while the budget lasts,
+	 * the rest fall back to the center distance */
+	size_t brick_size = sizeof(float) * res * res * res;
+	size_t cells_size = num_cells * (sizeof(float) + sizeof(int32_t));
+	size_t max_bricks = budget > cells_size
+	                    ? (budget - cells_size) / brick_size : 0;
+	float band = map->cell_size * 0.8660254f + bricks_spacing(map);
+	int32_t* brick_cells = malloc(sizeof(int32_t) * num_cells);
+
+	for (size_t cell = 0; cell < num_cells; cell++) {
+		map->brick[cell] = -1;
+		if (fabsf(map->cells[cell]) <= band
+		    && map->num_bricks < max_bricks) {
+			map->brick[cell] = map->num_bricks;
+			brick_cells[map->num_bricks++] = cell;
+		}
+	}
+
+	map->samples = malloc(brick_size * map->num_bricks);
+	job.brick_cells = brick_cells;
+	run_phase(&job, 1, num_threads);
+	free(brick_cells);
+
+	return map;
+}
+
+/* FNV-1a over everything that defines the cached distances */
+static
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+	const unsigned char* bytes = data;
+
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+
+	return hash;
+}
+
+static
+uint64_t hash_object(uint64_t hash, const struct object* obj) {
+	float values[4] = {obj->point.x, obj->point.y, obj->point.z, 0.f};
+
+	hash = hash_bytes(hash, &obj->type, sizeof(obj->type));
+	hash = hash_bytes(hash, values, sizeof(values));
+	switch (obj->type) {
+	case OBJ_SPHERE:
+		return hash_bytes(hash, &obj->sphere.radius, sizeof(float));
+	case OBJ_BOX:
+		values[0] = obj->box.point2.x;
+		values[1] = obj->box.point2.y;
+		values[2] = obj->box.point2.z;
+		values[3] = obj->box.radius;
+		return hash_bytes(hash, values, sizeof(values));
+	case OBJ_SMOOTH_UNION:
+		hash = hash_bytes(hash, &obj->smooth_op.smoothness,
+		                  sizeof(float));
+		hash = hash_object(hash, obj->smooth_op.a);
+		return hash_object(hash, obj->smooth_op.b);
+	default:
+		return hash;
+	}
+}
+
+static
+uint64_t bricks_key(const struct scene* scene, size_t budget, int res) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	uint64_t params[3] = {BRICKS_VERSION, budget, res};
+
+	hash = hash_bytes(hash, params, sizeof(params));
+	vector_foreach(struct object, scene->objects, obj)
+		hash = hash_object(hash, obj);
+
+	return hash;
+}
+
+struct bricks_header {
+	char		magic[8];
+	uint64_t	key;
+	float		origin[3];
+	float		cell_size;
+	int32_t		dims[3];
+	int32_t		res;
+	uint64_t	num_bricks;
+};
+
+static
+struct brick_map* bricks_load(const char* path, uint64_t key) {
+	struct bricks_header header;
+	struct brick_map* map;
+	FILE* file = fopen(path, "rb");
+
+	if (file == NULL)
+		return NULL;
+
+	if (fread(&header, sizeof(header), 1, file) != 1
+	    || memcmp(header.magic, BRICKS_MAGIC, 8) || header.key != key) {
+		fclose(file);
+		return NULL;
+	}
+
+	map = calloc(1, sizeof(struct brick_map));
+	map->origin = (v3) {header.origin[0], header.origin[1],
+	                    header.origin[2]};
+	map->cell_size = header.cell_size;
+	memcpy(map->dims, header.dims, sizeof(map->dims));
+	map->res = header.res;
+	map->num_bricks = header.num_bricks;
+
+	size_t num_cells = (size_t) map->dims[0] * map->dims[1] * map->dims[2];
+	size_t num_samples = map->num_bricks * map->res * map->res * map->res;
+	map->cells = malloc(sizeof(float) * num_cells);
+	map->brick = malloc(sizeof(int32_t) * num_cells);
+	map->samples = malloc(sizeof(float) * num_samples);
+
+	if (fread(map->cells, sizeof(float), num_cells, file) != num_cells
+	    || fread(map->brick, sizeof(int32_t), num_cells, file) != num_cells
+	    || fread(map->samples, sizeof(float), num_samples, file)
+	       != num_samples) {
+		bricks_free(map);
+		map = NULL;
+	}
+
+	fclose(file);
+	return map;
+}
+
+static
+void bricks_save(const struct brick_map* map, const char* path,
+	uint64_t key) {
+	struct bricks_header header = {
+		.magic		= BRICKS_MAGIC,
+		.key		= key,
+		.origin		= {map->origin.x, map->origin.y,
+				   map->origin.z},
+		.cell_size	= map->cell_size,
+		.dims		= {map->dims[0], map->dims[1],
+				   map->dims[2]},
+		.res		= map->res,
+		.num_bricks	= map->num_bricks
+	};
+	size_t num_cells = (size_t) map->dims[0] * map->dims[1] * map->dims[2];
+	size_t num_samples = map->num_bricks * map->res * map->res * map->res;
+	FILE* file = fopen(path, "wb");
+
+	if (file == NULL)
+		return;
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(map->cells, sizeof(float), num_cells, file);
+	fwrite(map->brick, sizeof(int32_t), num_cells, file);
+	fwrite(map->samples, sizeof(float), num_samples, file);
+	fclose(file);
+}
+
+struct brick_map* bricks_open(const struct scene* scene, const char* path,
+	size_t budget, int res, size_t num_threads) {
+	struct brick_map* map = NULL;
+	bool* bounded = malloc(sizeof(bool) * (scene->objects->size + 1));
+	bool any_bounded = false;
+	size_t idx = 0;
+	uint64_t key = bricks_key(scene, budget, res);
+
+	vector_foreach(struct object, scene->objects, obj) {
+		bounded[idx] = !isinf(object_bounds(obj).radius);
+		any_bounded |= bounded[idx++];
+	}
+
+	if (!any_bounded)
+		goto exit;
+
+	if (path && (map = bricks_load(path, key)))
+		goto exit;
+
+	map = bricks_build(scene, bounded, budget, res, num_threads);
+	if (path)
+		bricks_save(map, path, key);
+
+exit:
+	free(bounded);
+	return map;
+}
+
+void bricks_free(struct brick_map* map) {
+	if (map == NULL)
+		return;
+
+	free(map->cells);
+	free(map->brick);
+	free(map->samples);
+	free(map);
+}
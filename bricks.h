@@ -0,0 +1,84 @@
+#ifndef __BRICKS_H__
+#define __BRICKS_H__
+#include <stdint.h>
+#include "scene.h"
+#include "vec.h"
+
+/* Sparse sampling of the distance to the bounded objects of a static scene.
+ *
+ * The region around them is split into coarse cells. Cells on the surface
+ * band get a brick of res^3 samples (corners included) that is read with
+ * trilinear interpolation, every other cell only keeps the distance at its
+ * center. Lookups always return a lower bound of the distance. */
+struct brick_map {
+	v3	origin;		/* Min corner of the sampled region */
+	float	cell_size;	/* Side of a coarse cell */
+	int	dims[3];	/* Coarse cells per axis */
+	int	res;		/* Samples per brick side */
+	float*	cells;		/* Distance at each cell center */
+	int32_t* brick;		/* Brick of each cell or -1 */
+	float*	samples;	/* res^3 samples per brick, x-major */
+	size_t	num_bricks;
+};
+
+/* Load the map cached at path or build it (and then try to cache it there).
+ * path may be NULL to skip the disk cache. Returns NULL when the scene has
+ * no bounded objects. */
+struct brick_map* bricks_open(const struct scene* scene, const char* path,
+	size_t budget, int res, size_t num_threads);
+void bricks_free(struct brick_map* map);
+
+/* Spacing between the samples of a brick */
+static inline
+float bricks_spacing(const struct brick_map* map) {
+	return map->cell_size / (map->res - 1);
+}
+
+/* Lower bound of the distance from p to the bounded objects */
+static inline
+float bricks_dist(const struct brick_map* map, v3 p) {
+	v3 rel = v3scale(v3sub(p, map->origin), 1.f / map->cell_size);
+	v3 size = {map->dims[0], map->dims[1], map->dims[2]};
+
+	/* Outside of the region there's nothing closer than its border */
+	if (rel.x < 0.f || rel.y < 0.f || rel.z < 0.f
+	    || rel.x >= size.x || rel.y >= size.y || rel.z >= size.z) {
+		v3 out = v3sub(v3abs(v3sub(rel, v3scale(size, .5f))),
+		               v3scale(size, .5f));
+		v3 clamped = { maxf(out.x, 0.f), maxf(out.y, 0.f),
+		               maxf(out.z, 0.f) };
+		return v3len(clamped) * map->cell_size;
+	}
+
+	int cx = rel.x, cy = rel.y, cz = rel.z;
+	size_t cell = ((size_t) cz * map->dims[1] + cy) * map->dims[0] + cx;
+	int32_t brick = map->brick[cell];
+
+	if (brick < 0) {
+		/* 1-Lipschitz: it can't get closer faster than we move */
+		v3 center = {cx + .5f, cy + .5f, cz + .5f};
+		return map->cells[cell]
+		       - v3len(v3sub(rel, center)) * map->cell_size;
+	}
+
+	const int res = map->res;
+	const float* s = map->samples + (size_t) brick * res * res * res;
+	v3 local = v3scale(v3sub(rel, (v3) {cx, cy, cz}), res - 1);
+	int ix = minf(local.x, res - 2);
+	int iy = minf(local.y, res - 2);
+	int iz = minf(local.z, res - 2);
+	float fx = local.x - ix, fy = local.y - iy, fz = local.z - iz;
+
+	s += ((size_t) iz * res + iy) * res + ix;
+	float c00 = lerp(s[0], s[1], fx);
+	float c10 = lerp(s[res], s[res + 1], fx);
+	float c01 = lerp(s[res * res], s[res * res + 1], fx);
+	float c11 = lerp(s[res * res + res], s[res * res + res + 1], fx);
+	float value = lerp(lerp(c00, c10, fy), lerp(c01, c11, fy), fz);
+
+	/* The interpolation of a 1-Lipschitz function overestimates it by at
+	 * most half the diagonal of the sampling cube */
+	return value - bricks_spacing(map) * .8660254f;
+}
+
+#endif /* __BRICKS_H__ */
@@ -0,0 +1,121 @@
+#ifndef __FASTMATH_H__
+#define __FASTMATH_H__
+
+#include <math.h>
+#include <smmintrin.h>
+
+/* Polynomial approximations of the libm functions on the hot path, four
+ * lanes at a time. The max errors are measured against libm over the whole
+ * float range they take (log2 and pow for x > 0). Polynomials from Jose
+ * Fonseca's SSE2 exp2/log2 and the classic degree 11 minimax arctangent. */
+
+/* Absolute error < 1.4e-5 for normal x > 0 */
+static inline
+__m128 approx_log2_ps(__m128 x) {
+	const __m128i exp_mask = _mm_set1_epi32(0x7F800000);
+	const __m128i mant_mask = _mm_set1_epi32(0x007FFFFF);
+	const __m128 one = _mm_set1_ps(1.f);
+	__m128i i = _mm_castps_si128(x);
+	__m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(
+		_mm_srli_epi32(_mm_and_si128(i, exp_mask), 23),
+		_mm_set1_epi32(127)));
+	__m128 m = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(i, mant_mask)),
+	                     one);
+	__m128 p = _mm_set1_ps(-3.4436006e-2f);
+
+	/* log2(m) / (m - 1) for m in [1, 2) */
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(3.1821337e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.2315303f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(2.5988452f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-3.3241990f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(3.1157899f));
+
+	return _mm_add_ps(_mm_mul_ps(p, _mm_sub_ps(m, one)), e);
+}
+
+/* Relative error < 2e-7, x clamped to [-126, 128] */
+static inline
+__m128 approx_exp2_ps(__m128 x) {
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.f)),
+	               _mm_set1_ps(128.f));
+	__m128 ipart = _mm_floor_ps(x);
+	__m128 f = _mm_sub_ps(x, ipart);
+	__m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(ipart),
+	                                         _mm_set1_epi32(127)), 23);
+	__m128 p = _mm_set1_ps(1.8775767e-3f);
+
+	/* 2^f for f in [0, 1) */
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.9893397e-3f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5826318e-2f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4015361e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9315308e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9999994e-1f));
+
+	return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+/* x^y, 0 for x <= 0 and 1 for y == 0 (powf gives 1 for 0^0). Relative error
+ * < 7e-6 * |y| + 2e-7 for x in [2^-8, 1], where gamma and specular use it:
+ * gamma is off by < 0.001 of an 8-bit step */
+static inline
+__m128 approx_pow_ps(__m128 x, __m128 y) {
+	__m128 rval = approx_exp2_ps(_mm_mul_ps(approx_log2_ps(x), y));
+	rval = _mm_and_ps(rval, _mm_cmpgt_ps(x, _mm_setzero_ps()));
+	return _mm_blendv_ps(rval, _mm_set1_ps(1.f),
+	                     _mm_cmpeq_ps(y, _mm_setzero_ps()));
+}
+
+/* Absolute error < 2e-6 radians */
+static inline
+__m128 approx_atan_ps(__m128 x) {
+	const __m128 sign_mask = _mm_set1_ps(-0.f);
+	const __m128 one = _mm_set1_ps(1.f);
+	__m128 sign = _mm_and_ps(x, sign_mask);
+	__m128 ax = _mm_andnot_ps(sign_mask, x);
+	/* atan(x) = pi/2 - atan(1/x) past 1 */
+	__m128 big = _mm_cmpgt_ps(ax, one);
+	__m128 t = _mm_blendv_ps(ax, _mm_div_ps(one, ax), big);
+	__m128 t2 = _mm_mul_ps(t, t);
+	__m128 p = _mm_set1_ps(-0.01172120f);
+
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.05265332f));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(-0.11643287f));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.19354346f));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(-0.33262347f));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.99997726f));
+	p = _mm_mul_ps(p, t);
+	p = _mm_blendv_ps(p, _mm_sub_ps(_mm_set1_ps(1.57079633f), p), big);
+
+	return _mm_or_ps(p, sign);
+}
+
+/* rsqrtps and a Newton step, relative error < 2^-21 */
+static inline
+__m128 approx_rsqrt_ps(__m128 x) {
+	__m128 r = _mm_rsqrt_ps(x);
+	__m128 half_x = _mm_mul_ps(_mm_set1_ps(.5f), x);
+	return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f),
+	                                _mm_mul_ps(half_x, _mm_mul_ps(r, r))));
+}
+
+/* What the hot path calls: libm, or the approximations when built with
+ * FAST_MATH (make FAST_MATH=1) */
+static inline
+float hot_powf(float x, float y) {
+#ifdef FAST_MATH
+	return _mm_cvtss_f32(approx_pow_ps(_mm_set_ss(x), _mm_set_ss(y)));
+#else
+	return powf(x, y);
+#endif
+}
+
+static inline
+float hot_atanf(float x) {
+#ifdef FAST_MATH
+	return _mm_cvtss_f32(approx_atan_ps(_mm_set_ss(x)));
+#else
+	return atanf(x);
+#endif
+}
+
+#endif /* __FASTMATH_H__ */
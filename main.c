@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <SDL.h>
 
@@ -18,17 +19,34 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+/* Dynamic resolution, in eighths of the window side from a quarter up */
+#define SCALE_STEPS 8
+#define SCALE_MIN 2
+#define SCALE_FRAMES 8	/* Averaged for each decision */
+
+/* Of the frame buffer and its texture, output_row packs it with AVX2 */
+#define FRAME_FORMAT SDL_PIXELFORMAT_ARGB8888
+#define FRAME_BUFFERS 2	/* One rendered while the other is presented */
+
 SDL_atomic_t exiting;
 SDL_atomic_t current_line;
-SDL_sem* frame_entry_barrier;
-SDL_sem* frame_exit_barrier;
+struct barrier frame_barrier;
 
 /* key -> up/down */
 struct keyboard_state {
 	bool W, A, S, D, Space, LCtrl;	/* Movement */
 	bool Left, Right, Up, Down;	/* Rotation */
+	bool I, J, K, L, U, O;		/* Edits */
 } key;
 
+/* What the edit keys move around: Tab goes over the objects and then the
+ * lights, I/K J/L and U/O move it along z, x and y */
+struct selection {
+	bool	light;
+	size_t	index;
+	bool	off;	/* The renderer doesn't follow edits */
+};
+
 static
 void update_keyboard(struct keyboard_state* key, SDL_KeyboardEvent ev) {
 	bool state = ev.state == SDL_PRESSED;
@@ -64,9 +82,59 @@ void update_keyboard(struct keyboard_state* key, SDL_KeyboardEvent ev) {
 	case SDL_SCANCODE_RIGHT:
 		key->Right = state;
 		break;
+	case SDL_SCANCODE_I:
+		key->I = state;
+		break;
+	case SDL_SCANCODE_J:
+		key->J = state;
+		break;
+	case SDL_SCANCODE_K:
+		key->K = state;
+		break;
+	case SDL_SCANCODE_L:
+		key->L = state;
+		break;
+	case SDL_SCANCODE_U:
+		key->U = state;
+		break;
+	case SDL_SCANCODE_O:
+		key->O = state;
+		break;
 	}
 }
 
+static
+void select_next(struct selection* sel, const struct scene* scene) {
+	size_t count = sel->light ? scene->lights->size
+	                          : scene->objects->size;
+
+	if (sel->off)
+		return;
+	if (++sel->index >= count) {
+		sel->index = 0;
+		sel->light = !sel->light;
+		if (sel->light ? !scene->lights->size : !scene->objects->size)
+			sel->light = !sel->light;
+	}
+	LOG("selected %s %zu", sel->light ? "light" : "object", sel->index);
+}
+
+static
+void update_selection(const struct selection* sel, struct scene* scene) {
+	v3 offset = {
+		(key.L - key.J) * .1f, (key.U - key.O) * .1f,
+		(key.I - key.K) * .1f
+	};
+
+	if (sel->off || (offset.x == 0.f && offset.y == 0.f
+	                 && offset.z == 0.f))
+		return;
+	if (sel->light && sel->index < scene->lights->size)
+		scene_move_light(scene, sel->index, offset);
+	else if (!sel->light && sel->index < scene->objects->size)
+		scene_move_object(scene, sel->index, offset);
+}
+
 static
 void update_camera(struct scene* scene) {
 	struct camera* cam = &scene->camera;
@@ -111,39 +179,321 @@ void update_camera(struct scene* scene) {
 		                                    v3scale(right_dir, .1f)));
 }
 
+/* Returns whether it asks to quit */
+static
+bool handle_event(const SDL_Event* event, bool* paused,
+	struct selection* sel, const struct scene* scene) {
+	if (event->type == SDL_QUIT)
+		return true;
+	if (event->type == SDL_MOUSEBUTTONUP)
+		*paused = !*paused;
+	if (event->type == SDL_KEYDOWN && !event->key.repeat
+	    && event->key.keysym.scancode == SDL_SCANCODE_TAB)
+		select_next(sel, scene);
+	if (event->type == SDL_KEYDOWN || event->type == SDL_KEYUP)
+		update_keyboard(&key, event->key);
+	return false;
+}
+
+static
+void log_stats(const struct render_stats* stats) {
+	const Uint64* count = stats->count;
+	Uint64 primary = MAX(count[STAT_PRIMARY_RAYS], 1);
+	Uint64 shadow = MAX(count[STAT_SHADOW_RAYS], 1);
+
+	LOG("steps/ray\tprimary %.2f (%llu rays)\tshadow %.2f (%llu rays)",
+	    count[STAT_PRIMARY_STEPS] / (double) primary,
+	    (unsigned long long) count[STAT_PRIMARY_RAYS],
+	    count[STAT_SHADOW_STEPS] / (double) shadow,
+	    (unsigned long long) count[STAT_SHADOW_RAYS]);
+
+	if (count[STAT_SHADOW_CACHE_HITS])
+		LOG("shadow cache\t%llu hits (%.1f%%)",
+		    (unsigned long long) count[STAT_SHADOW_CACHE_HITS],
+		    100. * count[STAT_SHADOW_CACHE_HITS]
+		    / (count[STAT_SHADOW_CACHE_HITS]
+		       + count[STAT_SHADOW_RAYS]));
+
+	if (count[STAT_AA_PIXELS])
+		LOG("aa\t%llu pixels\t%llu extra rays",
+		    (unsigned long long) count[STAT_AA_PIXELS],
+		    (unsigned long long) count[STAT_AA_RAYS]);
+
+	if (count[STAT_CB_REPROJECTED] || count[STAT_CB_FILLED])
+		LOG("checkerboard\t%llu reprojected\t%llu filled",
+		    (unsigned long long) count[STAT_CB_REPROJECTED],
+		    (unsigned long long) count[STAT_CB_FILLED]);
+
+	if (count[STAT_VRS_INTERPOLATED] || count[STAT_VRS_SHADED])
+		LOG("vrs\t%llu interpolated\t%llu shaded",
+		    (unsigned long long) count[STAT_VRS_INTERPOLATED],
+		    (unsigned long long) count[STAT_VRS_SHADED]);
+
+	if (count[STAT_DIRTY_TILES] || count[STAT_CLEAN_TILES])
+		LOG("partial\t%llu dirty tiles\t%llu clean",
+		    (unsigned long long) count[STAT_DIRTY_TILES],
+		    (unsigned long long) count[STAT_CLEAN_TILES]);
+
+	/* Only some modes go through the stages */
+	static const char* stage_names[STAGE_COUNT] = {
+		"generate", "march", "normal", "shadow", "shade", "reconstruct",
+		"interpolate"
+	};
+	double ms_per_tick = 1000. / SDL_GetPerformanceFrequency();
+	for (size_t i = 0; i < STAGE_COUNT; i++)
+		if (stats->stage_items[i])
+			LOG("stage %s\t%llu rays\t%.2f ms (all threads)",
+			    stage_names[i],
+			    (unsigned long long) stats->stage_items[i],
+			    stats->stage_time[i] * ms_per_tick);
+}
+
 static
 void die(const char* str) {
 	perror(str);
 	exit(-1);
 }
 
+/* Render size controller for --target-ms: a step down when the average of
+ * the last frames goes over the target, a step up when the larger size would
+ * still make it (the time goes with the pixels, the square of the scale) */
+struct resolution {
+	float		target;		/* ms per frame, 0 never scales */
+	int		scale;		/* In SCALE_STEPS */
+	Uint32		frames;		/* Since the last decision */
+	Uint32		time;		/* Spent in them */
+};
+
+/* Returns whether the scale changed. Once the view stops it goes back to the
+ * full size and holds there, so the samples of a still view add up at a
+ * single size (the renderer starts them over on the size change). */
+static
+bool resolution_update(struct resolution* res, Uint32 frame_time,
+	bool still) {
+	float avg, next;
+
+	if (res->target <= 0.f)
+		return false;
+
+	if (still) {
+		res->frames = 0;
+		res->time = 0;
+		if (res->scale == SCALE_STEPS)
+			return false;
+		res->scale = SCALE_STEPS;
+		return true;
+	}
+
+	res->time += frame_time;
+	if (++res->frames < SCALE_FRAMES)
+		return false;
+
+	avg = res->time / (float) res->frames;
+	next = avg * (res->scale + 1) * (res->scale + 1)
+	       / (res->scale * res->scale);
+	res->frames = 0;
+	res->time = 0;
+
+	if (avg > res->target && res->scale > SCALE_MIN)
+		res->scale--;
+	else if (next < res->target && res->scale < SCALE_STEPS)
+		res->scale++;
+	else
+		return false;
+	return true;
+}
+
+static inline
+int resolution_scaled(const struct resolution* res, int size) {
+	return MAX(size * res->scale / SCALE_STEPS, 1);
+}
+
+/* What the renderers draw into: buffers kept from frame to frame, aligned
+ * for SIMD and wrapped in surfaces, that go up to a streaming texture and
+ * get stretched over the window by SDL_RenderCopy. The size follows the
+ * render resolution, not the window. With --pipeline the workers render
+ * into one while the other is presented. */
+struct frame {
+	SDL_Surface*	surf;
+	void*		pixels;
+	Uint32		sampled;	/* Ticks when its input was read */
+};
+
+struct framebuffer {
+	SDL_Renderer*	ren;
+	SDL_Texture*	tex;
+	int		tex_width;	/* Of the last frame uploaded */
+	int		tex_height;
+	struct frame	frame[FRAME_BUFFERS];
+	int		back;		/* The next one to render */
+};
+
+static
+void frame_resize(struct frame* frame, int width, int height) {
+	/* Rows start on cache lines */
+	int pitch = (width * 4 + 63) & ~63;
+
+	if (frame->surf && frame->surf->w == width
+	    && frame->surf->h == height)
+		return;
+
+	SDL_FreeSurface(frame->surf);
+	SDL_SIMDFree(frame->pixels);
+
+	frame->pixels = SDL_SIMDAlloc((size_t) pitch * height);
+	frame->surf = SDL_CreateRGBSurfaceWithFormatFrom(frame->pixels, width,
+		height, 32, pitch, FRAME_FORMAT);
+	if (!frame->pixels || !frame->surf)
+		die(SDL_GetError());
+}
+
+/* For --screenshot, as a binary PPM */
+static
+void frame_save(const struct frame* frame, const char* path) {
+	const SDL_Surface* surf = frame->surf;
+	FILE* file = fopen(path, "wb");
+
+	if (file == NULL)
+		die(path);
+
+	fprintf(file, "P6\n%d %d\n255\n", surf->w, surf->h);
+	for (int y = 0; y < surf->h; y++) {
+		const Uint32* row = (const Uint32*) ((const Uint8*) surf->pixels
+		                                     + y * surf->pitch);
+		for (int x = 0; x < surf->w; x++) {
+			Uint8 rgb[3];
+
+			SDL_GetRGB(row[x], surf->format, &rgb[0], &rgb[1],
+			           &rgb[2]);
+			fwrite(rgb, sizeof(rgb), 1, file);
+		}
+	}
+
+	if (fclose(file))
+		die(path);
+}
+
+/* The texture keeps the last frame, presenting it again skips the upload */
+static
+void framebuffer_present(struct framebuffer* fb, const struct frame* frame,
+	bool upload) {
+	int w = frame->surf->w;
+	int h = frame->surf->h;
+
+	if (upload && (w != fb->tex_width || h != fb->tex_height)) {
+		if (fb->tex)
+			SDL_DestroyTexture(fb->tex);
+		fb->tex = SDL_CreateTexture(fb->ren, FRAME_FORMAT,
+		                            SDL_TEXTUREACCESS_STREAMING, w, h);
+		if (fb->tex == NULL)
+			die(SDL_GetError());
+		fb->tex_width = w;
+		fb->tex_height = h;
+	}
+
+	if (upload && SDL_UpdateTexture(fb->tex, NULL, frame->pixels,
+	                                frame->surf->pitch))
+		die(SDL_GetError());
+	if (SDL_RenderCopy(fb->ren, fb->tex, NULL, NULL))
+		die(SDL_GetError());
+	SDL_RenderPresent(fb->ren);
+}
+
+static
+void framebuffer_free(struct framebuffer* fb) {
+	for (int i = 0; i < FRAME_BUFFERS; i++) {
+		SDL_FreeSurface(fb->frame[i].surf);
+		SDL_SIMDFree(fb->frame[i].pixels);
+	}
+	if (fb->tex)
+		SDL_DestroyTexture(fb->tex);
+	if (fb->ren)
+		SDL_DestroyRenderer(fb->ren);
+}
+
+/* Timing of the rendered frames */
+struct frame_stats {
+	Uint32	frames;
+	Uint32	min;
+	Uint32	max;
+	Uint32	total;
+	Uint32	start;		/* Of the frame in flight */
+	bool	still;		/* It has the view of the one before */
+};
+
+/* Hands the frame in data->surf to the workers */
+static
+void frame_begin(struct render_data* data, struct frame_stats* fs) {
+	if (SDL_MUSTLOCK(data->surf))
+		SDL_LockSurface(data->surf);
+
+	SDL_AtomicSet(&current_line, 0);
+	memset(&data->stats, 0, sizeof(data->stats));
+	fs->start = SDL_GetTicks();
+	render_begin_frame(data);
+	barrier_wait(&frame_barrier);
+}
+
+/* Waits for the workers to finish the frame in flight and logs it */
+static
+void frame_finish(struct render_data* data, struct frame_stats* fs,
+	struct resolution* res) {
+	Uint32 time;
+
+	barrier_wait(&frame_barrier);
+
+	time = SDL_GetTicks() - fs->start;
+	fs->frames++;
+	fs->total += time;
+	fs->min = MIN(fs->min, time);
+	fs->max = MAX(fs->max, time);
+
+	LOG("Frame %d\ttime %d", fs->frames, time);
+	LOG("min %d\tmax %d\tavg %f", fs->min, fs->max,
+	    fs->total / (float) fs->frames);
+	log_stats(&data->stats);
+	if (resolution_update(res, time, fs->still))
+		LOG("scale %d/%d", res->scale, SCALE_STEPS);
+
+	if (SDL_MUSTLOCK(data->surf))
+		SDL_UnlockSurface(data->surf);
+}
+
 int render_scene(struct scene* scene, size_t num_threads, int argc,
 	const char* argv[]) {
 
 	SDL_Window*	win;
 	SDL_Event	event;
+	struct resolution res = {.scale = SCALE_STEPS};
+	struct framebuffer fb = {0};
+	Uint32		renderer_flags = 0;	/* Whatever SDL finds best */
+	bool		pipeline = false;
 	bool		paused = false;
+	const char*	screenshot = NULL;	/* First frame goes there */
+	bool		idle = false;	/* Last frame is still good */
+	struct selection sel = {0};
+	struct frame*	rendering = NULL;	/* By the workers now */
+	struct frame*	ready = NULL;		/* Last one finished */
+
+	/* What the workers see: the scene as the last frame started, so the
+	 * camera can move while they are at it */
+	struct scene	view = *scene;
+	int		view_width = 0;
+	int		view_height = 0;
 
 	/* Performance counters */
-	Uint32		frames = 0;
-	Uint32		frame_start;
-	Uint32		frame_end;
-	Uint32		frame_min = 0xFFFFFFFF;
-	Uint32		frame_max = 0x0;
-	Uint32		frame_total= 0;
-	
+	struct frame_stats fs = {.min = 0xFFFFFFFF};
 
 	int width = 320;
 	int height = 240;
 
 	SDL_Thread** threads;
-	struct render_data data = {.scene = scene};
+	struct render_data data = {.scene = &view, .num_threads = num_threads};
 
 	threads = malloc(sizeof(SDL_Thread*) * num_threads);
 
 	LOG("Inicializando threads = %d", num_threads);
-	frame_entry_barrier = SDL_CreateSemaphore(0);
-	frame_exit_barrier  = SDL_CreateSemaphore(0);
+	barrier_init(&frame_barrier, num_threads + 1);
 	for (size_t i = 0; i < num_threads; i++)
 		threads[i] = SDL_CreateThread(render_thread, "renderer",
 		                              &data);
@@ -159,62 +509,119 @@ int render_scene(struct scene* scene, size_t num_threads, int argc,
 		die(SDL_GetError());
 
 	render_prepare(&data, argc, argv);
+	sel.off = !render_editable(&data);
+	if (sel.off)
+		LOG("edit keys off, the renderer doesn't follow edits");
+
+	for (int i = 3; i < argc; i++)
+		if (strcmp("--target-ms", argv[i]) == 0 && i + 1 < argc)
+			res.target = atof(argv[++i]);
+		else if (strcmp("--software", argv[i]) == 0)
+			renderer_flags = SDL_RENDERER_SOFTWARE;
+		else if (strcmp("--pipeline", argv[i]) == 0)
+			pipeline = true;
+		else if (strcmp("--screenshot", argv[i]) == 0 && i + 1 < argc)
+			screenshot = argv[++i];
+
+	/* Upscaled frames are filtered */
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+	fb.ren = SDL_CreateRenderer(win, -1, renderer_flags);
+	if (fb.ren == NULL)
+		die(SDL_GetError());
 
 	while (1) {
-		while (SDL_PollEvent(&event)) {
-			if (event.type == SDL_QUIT) {
-				SDL_AtomicSet(&exiting, 1);
-				for (size_t i = 0; i < num_threads; i++)
-					SDL_SemPost(frame_entry_barrier);
-				for (size_t i = 0; i < num_threads; i++)
-					SDL_WaitThread(threads[i], NULL);
-				goto exit;
-			}
-			if (event.type == SDL_MOUSEBUTTONUP)
-				paused = !paused;
-			if (event.type == SDL_KEYDOWN
-			    || event.type == SDL_KEYUP)
-				update_keyboard(&key, event.key);
+		bool quit = false;
+		bool fresh = false;	/* Ready is yet to be presented */
+		bool still;		/* Same view as the last frame */
+
+		/* Pipelined, the frame started last time rendered while the
+		 * one before was presented */
+		if (rendering) {
+			frame_finish(&data, &fs, &res);
+			ready = rendering;
+			rendering = NULL;
+			fresh = true;
 		}
 
-		update_camera(scene);
-
-		data.surf = SDL_GetWindowSurface(win);
-		if (data.surf == NULL)
-			die(SDL_GetError());
-
-		if (SDL_MUSTLOCK(data.surf))
-			SDL_LockSurface(data.surf);
+		/* Sleep until something happens rather than draw it again */
+		if (idle) {
+			if (!SDL_WaitEvent(&event))
+				die(SDL_GetError());
+			quit = handle_event(&event, &paused, &sel, scene);
+		}
+		while (!quit && SDL_PollEvent(&event))
+			quit = handle_event(&event, &paused, &sel, scene);
+
+		if (quit) {
+			SDL_AtomicSet(&exiting, 1);
+			barrier_wait(&frame_barrier);
+			for (size_t i = 0; i < num_threads; i++)
+				SDL_WaitThread(threads[i], NULL);
+			goto exit;
+		}
 
-		SDL_AtomicSet(&current_line, 0);
-		frame_start = SDL_GetTicks();
-		for (size_t i = 0; i < num_threads; i++)
-			SDL_SemPost(frame_entry_barrier);
-		for (size_t i = 0; i < num_threads; i++)
-			SDL_SemWait(frame_exit_barrier);
+		/* Paused the view holds still and the samples add up. No
+		 * frame is in flight here, the workers share the objects. */
+		if (!paused)
+			update_camera(scene);
+		update_selection(&sel, scene);
 
-		frame_end = SDL_GetTicks();
-		frames++;
-		frame_total += frame_end - frame_start;
-		frame_min = MIN(frame_min, frame_end - frame_start);
-		frame_max = MAX(frame_max, frame_end - frame_start);
+		if (SDL_GetRendererOutputSize(fb.ren, &width, &height))
+			die(SDL_GetError());
+		width = resolution_scaled(&res, width);
+		height = resolution_scaled(&res, height);
+
+		still = camera_equal(&scene->camera, &view.camera)
+		        && scene->generation == view.generation;
+		idle = still && width == view_width && height == view_height
+		       && !render_refining(&data);
+
+		if (!idle) {
+			rendering = &fb.frame[fb.back];
+			if (pipeline)
+				fb.back = (fb.back + 1) % FRAME_BUFFERS;
+
+			frame_resize(rendering, width, height);
+			rendering->sampled = SDL_GetTicks();
+			view = *scene;
+			view_width = width;
+			view_height = height;
+			data.surf = rendering->surf;
+			fs.still = still;
+			frame_begin(&data, &fs);
+
+			if (!pipeline) {
+				frame_finish(&data, &fs, &res);
+				ready = rendering;
+				rendering = NULL;
+				fresh = true;
+			}
+		}
 
-		LOG("Frame %d\ttime %d", frames, frame_end - frame_start);
-		LOG("min %d\tmax %d\tavg %f", frame_min, frame_max,
-		    frame_total / (float) frames);
+		if (ready) {
+			framebuffer_present(&fb, ready, fresh);
+			/* From reading the input to showing what it did */
+			if (fresh)
+				LOG("latency %d", SDL_GetTicks()
+				                  - ready->sampled);
+		}
 
-		if (SDL_MUSTLOCK(data.surf))
-			SDL_UnlockSurface(data.surf);
+		/* Saved, the quit goes the way of any other */
+		if (screenshot && fresh) {
+			SDL_Event quit_event = {.type = SDL_QUIT};
 
-		SDL_UpdateWindowSurface(win);
-		SDL_FreeSurface(data.surf);
+			frame_save(ready, screenshot);
+			LOG("screenshot %s", screenshot);
+			screenshot = NULL;
+			if (SDL_PushEvent(&quit_event) < 0)
+				die(SDL_GetError());
+		}
 	}
 exit:
 	render_destroy(&data);
+	framebuffer_free(&fb);
 	LOG("Cerrando");
 	free(threads);
-	SDL_DestroySemaphore(frame_entry_barrier);
-	SDL_DestroySemaphore(frame_exit_barrier);
 	SDL_DestroyWindow(win);
 	SDL_Quit();
 	return 0;
@@ -233,6 +640,7 @@ int main(int argc, const char* argv[]) {
 
 	scene = scene_parse(filename);
 	assert(scene && scene_validate_materials(scene));
+	scene_prepare(scene);
 
 	render_scene(scene, num_threads, argc, argv);
 
@@ -1,102 +1,640 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bricks.h"
+#include "output.h"
 #include "renderer.h"
 #include "sdf.h"
+#include "shadow_cache.h"
 #include "vec.h"
+#include "vecx.h"
+
+/* Side of the screen-space tiles used to cull objects and lights, in pixels */
+#define TILE_SIZE 16
+
+/* Adaptive anti-aliasing: a pixel is on an edge when a neighbour shows
+ * another object, a normal further than this cosine or a brightness (square
+ * root of the luma, roughly gamma) further than the contrast */
+#define AA_MAX_SAMPLES 16
+#define AA_NORMAL_COS .9f
+#define AA_CONTRAST .0625f
+
+/* Reprojected hits farther than this from the distance in the history (as a
+ * fraction of it) are something else */
+#define CB_DEPTH_TOLERANCE .05f
+
+/* Variable-rate shading: each tile is lit at every pixel, every 2x2 or every
+ * 4x4. The coarser rates take tiles whose normals spread less than this
+ * (one minus the length of their average) and whose brightness changed less
+ * than the contrast between neighbours in the last frame, the 4x4 one a
+ * quarter of each and a single object. */
+#define VRS_TILE 8
+#define VRS_NORMAL_SPREAD .02f
+#define VRS_CONTRAST .0625f
+/* Samples farther than this from the pixel (as a fraction of its distance)
+ * don't take part in its interpolation */
+#define VRS_DEPTH_TOLERANCE .05f
+
+/* Shadow rays marched together, one per AVX lane */
+#define SHADOW_LANES 8
+#define SHADOW_STEPS 128
+#define SHADOW_SHARPNESS 50.f
+
+/* Per-frame screen-space binning of the scene objects (or lights): each tile
+ * lists the ones whose bounds project onto it, in scene order */
+struct tiles {
+	int	width;		/* Tiles per row */
+	int	height;		/* Tiles per column */
+	size_t	capacity;	/* Max items per tile */
+	Uint32*	count;		/* Items in each tile */
+	Uint32*	items;		/* Indices, capacity per tile */
+};
+
+/* Output of the geometry pass, one entry per pixel. Misses have id 0 and
+ * nothing else set. */
+struct gbuffer {
+	int	width;
+	int	height;
+	float*	dist;
+	Uint32*	id;
+	v3*	normal;
+	v3*	color;	/* Of the lighting pass, only with --aa */
+};
+
+/* What the last frame saw, for checkerboard frames to reproject */
+struct history {
+	int		width;
+	int		height;
+	bool		valid;		/* There is a last frame of this size */
+	struct camera	camera;		/* It was seen from */
+	float*		dist;
+	Uint32*		id;
+	v3*		color;
+};
+
+/* Shadows of a light traced once every scale x scale pixels, at the hit of
+ * the pixel in the middle of each block. The lighting pass upsamples them. */
+struct shadow_map {
+	int	scale;		/* 1 traces the shadow of every pixel */
+	int	width;
+	int	height;
+	float*	shadow;		/* Negative where the sample missed */
+	v3*	point;
+	v3*	normal;
+};
+
+/* Per-thread stage queues of the wavefront mode, every stage compacts the
+ * rays that go on to the next one at the front of the arrays */
+struct wavefront {
+	size_t	capacity;
+	size_t	num_lights;
+	Uint32*	pixel;		/* x of the pixel in the current row */
+	v3*	dir;
+	float*	dist;
+	Uint32*	id;
+	v3*	normal;
+	float*	shadow;		/* num_lights per ray */
+	float*	weight;		/* Of the shadows, 0 for the unlit */
+};
 
-struct world_dist {
-	float dist;
-	Uint32 id;
+/* Part of a ray inside the bounds of an object */
+struct span {
+	float from;
+	float to;
 };
 
+struct naive_data {
+	const struct scene*	scene;
+	struct bounds*		bounds;	/* Updated every frame */
+	struct tiles		tiles;
+	struct bounds*		light_bounds;	/* Updated every frame */
+	struct tiles		light_tiles;
+	float			light_threshold;	/* Not worth a shadow */
+	int			light_samples;	/* Per pixel, 0 for all */
+	Uint32			frame;
+	struct brick_map*	bricks;	/* NULL unless --bricks */
+	unsigned		bricks_generation;	/* Up to date with */
+	float			omega;	/* Over-relaxation factor */
+	float			pixel_angle;	/* Updated every frame */
+	float			lod;	/* Min projected size in pixels */
+	bool			wavefront;
+	Uint32*			unbounded;	/* Not in the bricks */
+	size_t			num_unbounded;
+	struct gbuffer		gbuffer;
+	/* Between the passes of a frame, only the render threads take part
+	 * (frame_barrier has the main thread too) */
+	struct barrier		barrier;
+	SDL_atomic_t		shade_line;	/* Lighting pass row */
+	int			aa_samples;	/* Per edge pixel, 0 for none */
+	float			aa_budget;	/* Max extra rays per pixel */
+	int			aa_rays_max;	/* Of this frame */
+	SDL_atomic_t		aa_line;	/* AA pass row, counting */
+	SDL_atomic_t		aa_counted;	/* Rows done counting */
+	SDL_atomic_t		aa_trace_line;	/* AA pass row, tracing */
+	int*			aa_edges;	/* In each row, then before */
+	int			aa_extra;	/* Rays per traced edge pixel */
+	float			aa_ratio;	/* Of the edge pixels traced */
+	bool			checkerboard;
+	bool			cb_frame;	/* This one traces half */
+	int			cb_parity;	/* Of the pixels it traces */
+	struct camera		cb_camera;	/* Of the last frame */
+	struct history		history;
+	SDL_atomic_t		cb_line;	/* Reconstruction row */
+	bool			vrs;
+	bool			vrs_overlay;	/* Tints the tiles by rate */
+	bool			vrs_frame;	/* This one shades at rates */
+	int			vrs_origin;	/* x of the first sample */
+	int			vrs_width;	/* Tiles per row */
+	int			vrs_height;
+	Uint8*			vrs_rate;	/* Of each tile, 1, 2 or 4 */
+	const v3*		vrs_colors;	/* Of the last frame, or NULL */
+	SDL_atomic_t		vrs_line;	/* Rate pass tile row */
+	SDL_atomic_t		vrs_fill_line;	/* Interpolation row */
+	/* Partial frames after edits that leave the view as it was */
+	bool			dirty_regions;	/* Off with --no-dirty */
+	bool			partial;	/* This one skips clean tiles */
+	Uint8*			dirty;		/* Per culling tile */
+	v3*			last;		/* Colors of the last frame */
+	int			last_width;	/* 0 before the first one */
+	int			last_height;
+	struct camera		last_camera;
+	v2			last_jitter;	/* Of its G-buffer */
+	unsigned		last_generation;	/* Of the scene */
+	int			shadow_scale;	/* For lights without one */
+	struct shadow_map*	shadow_maps;	/* One per light */
+	size_t			num_shadow_maps;
+	int			shadow_rows;	/* Of the maps with scale > 1 */
+	SDL_atomic_t		shadow_line;	/* Shadow pass row */
+	struct shadow_cache*	shadow_cache;	/* NULL unless --shadow-cache */
+	unsigned		cache_generation;	/* Of the scene */
+	struct output_format	output;		/* Of the surface */
+	/* Progressive supersampling while the view holds still */
+	Uint32			max_samples;	/* 0 turns it off */
+	Uint32			samples;	/* In accum, this frame's too */
+	bool			converged;	/* Nothing left to add */
+	v2			jitter;		/* Of this frame's sample */
+	v3*			accum;		/* Sum of the samples, HDR */
+	int			accum_width;
+	int			accum_height;
+	struct camera		accum_camera;
+	unsigned		accum_generation;	/* Of the scene */
+};
+
+/* Width of the cone traced by a pixel at the given distance from the camera,
+ * nothing finer than that can show up on screen */
 static inline
-float get_obj_dist(const struct object* obj, v3 p) {
-	v3 point = v3sub(p, obj->point);
-	switch (obj->type) {
-		float a_dist, b_dist;
-	case OBJ_SPHERE:
-		return sdSphere(point, obj->sphere.radius);
-	case OBJ_BOX:
-		return sdRoundBox(point, obj->box.point2, obj->box.radius);
-	case OBJ_PLANE:
-		return point.y;
-	case OBJ_SMOOTH_UNION:
-		a_dist = get_obj_dist(obj->smooth_op.a, p);
-		b_dist = get_obj_dist(obj->smooth_op.b, p);
-		return sminf(a_dist, b_dist, obj->smooth_op.smoothness);
-	default:
-		fprintf(stderr, "Unknown scene object\n");
-	}
+float footprint(const struct naive_data* naive, float dist) {
+	static const float	EPSILON = 0.001f;
+
+	return maxf(EPSILON, dist * naive->pixel_angle);
 }
 
+/* sdf() restricted to a list of object indices */
 static inline
-struct world_dist sdf(const struct scene* scene, v3 p) {
-	size_t obj_id = 0;
-	float obj_dist = INFINITY;
-	struct world_dist rval = {obj_dist, obj_id};
+struct world_dist sdf_list(const struct scene* scene, const Uint32* list,
+	size_t count, v3 p) {
+	const struct object* objects = scene->objects->data;
+	struct world_dist rval = {INFINITY, 0};
 
-	vector_foreach(struct object, scene->objects, obj) {
-		obj_dist = get_obj_dist(obj, p);
-		obj_id += 1;
+	for (size_t i = 0; i < count; i++) {
+		float obj_dist = get_obj_step(&objects[list[i]], p);
 		if (obj_dist < rval.dist)
-			rval = (struct world_dist) {obj_dist, obj_id};
+			rval = (struct world_dist) {obj_dist, list[i] + 1};
+	}
+
+	return rval;
+}
+
+/* Distance of sdf_list at eight points */
+static inline
+__m256 sdf8_list(const struct scene* scene, const Uint32* list, size_t count,
+	const v3x8* p) {
+	const struct object* objects = scene->objects->data;
+	__m256 rval = _mm256_set1_ps(INFINITY);
+
+	for (size_t i = 0; i < count; i++)
+		rval = _mm256_min_ps(get_obj_step8(&objects[list[i]], p), rval);
+
+	return rval;
+}
+
+/* Distance used to march towards the listed objects (all when list is NULL).
+ * While the brick map says every bounded object is further than near only
+ * the unbounded ones are evaluated, the id is 0 when the bricks are closer. */
+static inline
+struct world_dist march_dist(const struct naive_data* naive,
+	const Uint32* list, size_t count, v3 p, float near) {
+	const struct object* objects = naive->scene->objects->data;
+
+	if (naive->bricks) {
+		struct world_dist rval = {bricks_dist(naive->bricks, p), 0};
+		if (rval.dist > near) {
+			for (size_t i = 0; i < naive->num_unbounded; i++) {
+				Uint32 idx = naive->unbounded[i];
+				float dist = get_obj_step(&objects[idx], p);
+				if (dist < rval.dist)
+					rval = (struct world_dist) {dist,
+					                            idx + 1};
+			}
+			return rval;
+		}
+	}
+
+	if (list)
+		return sdf_list(naive->scene, list, count, p);
+
+	return sdf(naive->scene, p);
+}
+
+/* Clip a ray against the bounds of an object grown by slack. The span is
+ * empty (from > to) when the ray can't get that close to the object. */
+static inline
+struct span get_span(const struct object* obj, struct bounds bounds, v3 ro,
+	v3 rd, float slack, float max_dist) {
+	struct span rval = {0.f, max_dist};
+
+	if (obj->type == OBJ_PLANE) {
+		/* Everything below the plane */
+		float height = ro.y - obj->point.y - slack;
+		if (height > 0.f)
+			rval.from = rd.y < 0.f ? height / -rd.y : INFINITY;
+		return rval;
 	}
 
+	if (isinf(bounds.radius))
+		return rval;
+
+	v3 oc = v3sub(ro, bounds.center);
+	float radius = bounds.radius + slack;
+	float b = v3dot(oc, rd);
+	float disc = b * b - v3dot(oc, oc) + radius * radius;
+	if (disc < 0.f)
+		return (struct span) {INFINITY, 0.f};
+
+	disc = sqrtf(disc);
+	rval.from = maxf(-b - disc, 0.f);
+	rval.to = minf(-b + disc, max_dist);
 	return rval;
 }
 
-/* ro = ray origin, rd = ray direction */
+/* ro = ray origin, rd = ray direction, only the listed objects are tested.
+ * The ray is first clipped against their bounds: marching starts at the
+ * nearest span, jumps over the gaps and rays with no spans miss right away.
+ * spans must have room for count elements.
+ *
+ * Steps are over-relaxed by naive->omega (Keinert et al., "Enhanced Sphere
+ * Tracing"): whenever the unbounding spheres of two consecutive points don't
+ * overlap a surface may have been skipped, so the ray goes back to the
+ * previous point and keeps marching with plain steps. */
 static
-struct world_dist get_intersection(const struct scene* scene, v3 ro, v3 rd) {
+struct world_dist get_intersection(const struct naive_data* naive,
+	struct render_stats* stats, const Uint32* list, size_t count,
+	struct span* spans, v3 ro, v3 rd) {
 	static const size_t	MAX_STEPS = 256;
 	static const float	EPSILON = 0.001f;
 	static const float	MAX_DIST = 100.f;
 
+	const struct object* objects = naive->scene->objects->data;
+	const struct bounds* bounds = naive->bounds;
+	float	spacing = naive->bricks ? bricks_spacing(naive->bricks) : 0.f;
+	float	omega = naive->omega;
+	struct world_dist rval = { MAX_DIST, 0 };
 	size_t	id = 0;
 	float	dist = 0.f;
-	
-	for (size_t i = 0; i < MAX_STEPS; i++) {
-		v3 p = v3add(ro, v3scale(rd, dist));
-		struct world_dist scene_dist = sdf(scene, p);
-		dist += scene_dist.dist;
-		id = scene_dist.id;
-		if (scene_dist.dist < EPSILON || dist > MAX_DIST)
-			break;
+	size_t	num_spans = 0;
+	size_t	steps = 0;
+
+	/* Insertion sort by start, lists are short */
+	for (size_t i = 0; i < count; i++) {
+		struct span span = get_span(&objects[list[i]], bounds[list[i]],
+		                            ro, rd, EPSILON, MAX_DIST);
+		if (span.from > span.to)
+			continue;
+
+		size_t j = num_spans++;
+		for (; j > 0 && spans[j - 1].from > span.from; j--)
+			spans[j] = spans[j - 1];
+		spans[j] = span;
 	}
 
-	if (dist >= MAX_DIST)
-		id = 0;
+	for (size_t s = 0; s < num_spans; s++) {
+		float to = spans[s].to;
+		float prev_dist = 0.f;
+		float step = 0.f;
+		dist = maxf(dist, spans[s].from);
+
+		/* Merge the overlapping spans */
+		while (s + 1 < num_spans && spans[s + 1].from <= to)
+			to = maxf(to, spans[++s].to);
+
+		while (dist <= to) {
+			if (steps++ == MAX_STEPS) {
+				rval = (struct world_dist){ dist, id };
+				goto exit;
+			}
+
+			v3 p = v3add(ro, v3scale(rd, dist));
+			float hit = footprint(naive, dist) * .5f;
+			/* A brick bound is never a hit, it's only used while
+			 * it's further than that */
+			struct world_dist scene_dist = march_dist(naive, list,
+				count, p, maxf(spacing, hit));
+
+			if (omega > 1.f
+			    && fabsf(scene_dist.dist) + prev_dist < step) {
+				dist += prev_dist - step;
+				omega = 1.f;
+				continue;
+			}
+
+			id = scene_dist.id;
+			if (scene_dist.dist < hit) {
+				rval = (struct world_dist){
+					dist + scene_dist.dist, id };
+				goto exit;
+			}
+
+			/* Never relax past the span, what's left of it
+			 * wouldn't be checked */
+			prev_dist = scene_dist.dist;
+			step = prev_dist * omega;
+			if (dist + step > to)
+				step = prev_dist;
+			dist += step;
+		}
+	}
 
-	return (struct world_dist){ dist, id };
+exit:
+	stats->count[STAT_PRIMARY_RAYS]++;
+	stats->count[STAT_PRIMARY_STEPS] += steps;
+	return rval;
 }
 
-/* https://iquilezles.org/www/articles/rmshadows/rmshadows.htm */
+/* get_intersection of up to eight rays from ro, one per lane, against the
+ * same list of objects and without bricks. Each lane marches from the start
+ * of its nearest span to the end of its furthest one, over the gaps, and
+ * stops on its own. sdf8 has no ids, the hits get theirs from sdf_list. */
 static
-float softshadow(const struct scene* scene, v3 ro, v3 rd, size_t max_steps,
-	float max_dist, float w) {
+void get_intersection8(const struct naive_data* naive,
+	struct render_stats* stats, const Uint32* list, size_t count, v3 ro,
+	const v3* rd, size_t lanes, struct world_dist* rval) {
+	static const size_t	MAX_STEPS = 256;
 	static const float	EPSILON = 0.001f;
+	static const float	MAX_DIST = 100.f;
+
+	const struct object* objects = naive->scene->objects->data;
+	const struct bounds* bounds = naive->bounds;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.f);
+	const __m256 abs_mask = _mm256_castsi256_ps(
+		_mm256_set1_epi32(0x7FFFFFFF));
+	const __m256 angle = _mm256_set1_ps(naive->pixel_angle);
+	float from[8];
+	float to[8];
+	float dist[8];
+	float at[8];
+
+	for (size_t i = 0; i < 8; i++) {
+		const v3 dir = rd[i < lanes ? i : 0];
+
+		from[i] = INFINITY;
+		to[i] = 0.f;
+		for (size_t j = 0; j < count && i < lanes; j++) {
+			struct span span = get_span(&objects[list[j]],
+				bounds[list[j]], ro, dir, EPSILON, MAX_DIST);
+			if (span.from > span.to)
+				continue;
+			from[i] = minf(from[i], span.from);
+			to[i] = maxf(to[i], span.to);
+		}
+	}
+
+	v3x8 vro = v3x8fill(ro);
+	v3x8 vrd = v3x8load(rd, lanes);
+	__m256 vdist = _mm256_loadu_ps(from);
+	__m256 vto = _mm256_loadu_ps(to);
+	__m256 omega = _mm256_set1_ps(naive->omega);
+	__m256 prev_dist = zero;
+	__m256 step = zero;
+	__m256 hit_dist = _mm256_set1_ps(MAX_DIST);
+	__m256 hit_at = zero;
+	__m256 hits = zero;
+	/* Rays with no spans miss right away */
+	__m256 active = _mm256_cmp_ps(vdist, vto, _CMP_LE_OQ);
+	int mask = _mm256_movemask_ps(active);
+
+	for (size_t s = 0; s < MAX_STEPS && mask; s++) {
+		v3x8 p = v3x8add(vro, v3x8scale(vrd, vdist));
+		__m256 hit = _mm256_mul_ps(_mm256_max_ps(
+			_mm256_mul_ps(vdist, angle),
+			_mm256_set1_ps(EPSILON)), _mm256_set1_ps(.5f));
+		__m256 scene_dist = sdf8_list(naive->scene, list, count, &p);
+		stats->count[STAT_PRIMARY_STEPS] += __builtin_popcount(mask);
+
+		/* Back to the last point, with plain steps from there */
+		__m256 back = _mm256_and_ps(active, _mm256_and_ps(
+			_mm256_cmp_ps(omega, one, _CMP_GT_OQ),
+			_mm256_cmp_ps(_mm256_add_ps(_mm256_and_ps(scene_dist,
+			                                          abs_mask),
+			                            prev_dist),
+			              step, _CMP_LT_OQ)));
+		vdist = _mm256_blendv_ps(vdist, _mm256_add_ps(vdist,
+			_mm256_sub_ps(prev_dist, step)), back);
+		omega = _mm256_blendv_ps(omega, one, back);
+
+		__m256 march = _mm256_andnot_ps(back, active);
+		__m256 hit_now = _mm256_and_ps(march,
+			_mm256_cmp_ps(scene_dist, hit, _CMP_LT_OQ));
+		hit_dist = _mm256_blendv_ps(hit_dist,
+			_mm256_add_ps(vdist, scene_dist), hit_now);
+		hit_at = _mm256_blendv_ps(hit_at, vdist, hit_now);
+		hits = _mm256_or_ps(hits, hit_now);
+
+		/* Never relax past the end */
+		__m256 relaxed = _mm256_mul_ps(scene_dist, omega);
+		relaxed = _mm256_blendv_ps(relaxed, scene_dist, _mm256_cmp_ps(
+			_mm256_add_ps(vdist, relaxed), vto, _CMP_GT_OQ));
+		march = _mm256_andnot_ps(hit_now, march);
+		prev_dist = _mm256_blendv_ps(prev_dist, scene_dist, march);
+		step = _mm256_blendv_ps(step, relaxed, march);
+		vdist = _mm256_blendv_ps(vdist, _mm256_add_ps(vdist, relaxed),
+		                         march);
+
+		active = _mm256_andnot_ps(hit_now, active);
+		active = _mm256_and_ps(active,
+			_mm256_cmp_ps(vdist, vto, _CMP_LE_OQ));
+		mask = _mm256_movemask_ps(active);
+	}
+
+	/* Out of steps, they count as hits where they are */
+	hit_dist = _mm256_blendv_ps(hit_dist, vdist, active);
+	hit_at = _mm256_blendv_ps(hit_at, vdist, active);
+	mask = _mm256_movemask_ps(_mm256_or_ps(hits, active));
+	_mm256_storeu_ps(dist, hit_dist);
+	_mm256_storeu_ps(at, hit_at);
+
+	for (size_t i = 0; i < lanes; i++) {
+		rval[i] = (struct world_dist) { MAX_DIST, 0 };
+		if (mask & 1 << i) {
+			v3 p = v3add(ro, v3scale(rd[i], at[i]));
+			rval[i].dist = dist[i];
+			rval[i].id = sdf_list(naive->scene, list, count, p).id;
+		}
+	}
+	stats->count[STAT_PRIMARY_RAYS] += lanes;
+}
 
+/* https://iquilezles.org/www/articles/rmshadows/rmshadows.htm */
+static
+float softshadow(const struct naive_data* naive, struct render_stats* stats,
+	v3 ro, v3 rd, size_t max_steps, float max_dist, float w) {
 	float res = 1.f;
 	float dist = 0.f;
+	float spacing = naive->bricks ? bricks_spacing(naive->bricks) : 0.f;
 
 	for (size_t i = 0; i < max_steps; i++) {
 		v3 p = v3add(ro, v3scale(rd, dist));
-		float scene_dist = sdf(scene, p).dist;
+		/* Bounds that can't darken the penumbra are good enough */
+		float near = maxf(dist / w, spacing);
+		float scene_dist = march_dist(naive, NULL, 0, p, near).dist;
+		stats->count[STAT_SHADOW_STEPS]++;
 		res = minf(res, w * scene_dist / dist);
 		dist += scene_dist;
 		if (res < -1 || dist > max_dist)
 			break;
 	}
+	stats->count[STAT_SHADOW_RAYS]++;
 	res = maxf(res, 0.f);
 	return res;
 }
 
 static
-float in_shadow(const struct scene* scene, const struct light* light, v3 p) {
+float in_shadow(const struct naive_data* naive, struct render_stats* stats,
+	const struct light* light, v3 p) {
 	float light_dist = v3len(v3sub(light->point, p));
 
 	v3 dir = v3normalize(v3sub(light->point, p));
 	p = v3add(p, dir);
 
-	return softshadow(scene, p, dir, 128, light_dist, 50.f);
+	return softshadow(naive, stats, p, dir, SHADOW_STEPS, light_dist,
+	                  SHADOW_SHARPNESS);
+}
+
+/* softshadow of up to SHADOW_LANES rays at once, one per lane, straight on
+ * the scene SDF. Each lane stops on its own and the march goes on while any
+ * is left, every lane ends up with what softshadow would give it. */
+static
+void softshadow8(const struct scene* scene, struct render_stats* stats,
+	const v3* ro, const v3* rd, const float* max_dist, size_t count,
+	size_t max_steps, float w, float* res) {
+	const __m256 zero = _mm256_setzero_ps();
+	float lanes[SHADOW_LANES];
+
+	/* Unused lanes repeat the first ray, masked out from the start */
+	for (size_t i = 0; i < SHADOW_LANES; i++)
+		lanes[i] = max_dist[i < count ? i : 0];
+
+	v3x8 vro = v3x8load(ro, count);
+	v3x8 vrd = v3x8load(rd, count);
+	__m256 vmax = _mm256_loadu_ps(lanes);
+	__m256 vw = _mm256_set1_ps(w);
+	__m256 vres = _mm256_set1_ps(1.f);
+	__m256 vdist = zero;
+	__m256 active = _mm256_castsi256_ps(_mm256_cmpgt_epi32(
+		_mm256_set1_epi32(count),
+		_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	int mask = _mm256_movemask_ps(active);
+
+	for (size_t i = 0; i < max_steps && mask; i++) {
+		v3x8 p = v3x8add(vro, v3x8scale(vrd, vdist));
+		__m256 scene_dist = sdf8(scene, &p);
+		__m256 ratio = _mm256_div_ps(_mm256_mul_ps(vw, scene_dist),
+		                             vdist);
+		stats->count[STAT_SHADOW_STEPS] += __builtin_popcount(mask);
+
+		vres = _mm256_blendv_ps(vres, _mm256_min_ps(vres, ratio),
+		                        active);
+		vdist = _mm256_blendv_ps(vdist,
+		                         _mm256_add_ps(vdist, scene_dist),
+		                         active);
+		__m256 done = _mm256_or_ps(
+			_mm256_cmp_ps(vres, _mm256_set1_ps(-1.f), _CMP_LT_OQ),
+			_mm256_cmp_ps(vdist, vmax, _CMP_GT_OQ));
+		active = _mm256_andnot_ps(done, active);
+		mask = _mm256_movemask_ps(active);
+	}
+	stats->count[STAT_SHADOW_RAYS] += count;
+
+	_mm256_storeu_ps(lanes, _mm256_max_ps(vres, zero));
+	memcpy(res, lanes, sizeof(float) * count);
+}
+
+/* The shadow of the light l at p if the cache has it, negative if not */
+static inline
+float cached_shadow(const struct naive_data* naive, struct render_stats* stats,
+	size_t l, v3 p, v3 n) {
+	float shadow;
+
+	if (naive->shadow_cache == NULL)
+		return -1.f;
+
+	shadow = shadow_cache_lookup(naive->shadow_cache, l, p, n);
+	if (shadow >= 0.f)
+		stats->count[STAT_SHADOW_CACHE_HITS]++;
+	return shadow;
+}
+
+/* in_shadow of several lights (up to SHADOW_LANES) at p, marched together
+ * when there's more than one and no bricks (their near bound is per lane).
+ * Each one goes to shadow[slots[i]] and to the shadow cache, if there's one,
+ * so they should have been looked up there first. */
+static
+void trace_shadows(const struct naive_data* naive, struct render_stats* stats,
+	const Uint32* l, const Uint32* slots, size_t count, v3 p, v3 n,
+	float* shadow) {
+	const struct light* lights = naive->scene->lights->data;
+	v3 ro[SHADOW_LANES];
+	v3 rd[SHADOW_LANES];
+	float max_dist[SHADOW_LANES];
+	float res[SHADOW_LANES];
+
+	/* Everything was cached or out of range */
+	if (!count)
+		return;
+
+	if (naive->bricks || count == 1) {
+		for (size_t i = 0; i < count; i++)
+			res[i] = in_shadow(naive, stats, &lights[l[i]], p);
+	} else {
+		/* The same rays in_shadow traces */
+		for (size_t i = 0; i < count; i++) {
+			max_dist[i] = v3len(v3sub(lights[l[i]].point, p));
+			rd[i] = v3normalize(v3sub(lights[l[i]].point, p));
+			ro[i] = v3add(p, rd[i]);
+		}
+		softshadow8(naive->scene, stats, ro, rd, max_dist, count,
+		            SHADOW_STEPS, SHADOW_SHARPNESS, res);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		shadow[slots[i]] = res[i];
+		if (naive->shadow_cache)
+			shadow_cache_insert(naive->shadow_cache, l[i], p, n,
+			                    res[i]);
+	}
+}
+
+/* in_shadow of the light l going through the shadow cache, if there's one */
+static
+float trace_shadow(const struct naive_data* naive, struct render_stats* stats,
+	size_t l, v3 p, v3 n) {
+	float shadow = cached_shadow(naive, stats, l, p, n);
+	Uint32 light = l;
+	Uint32 slot = 0;
+
+	if (shadow < 0.f)
+		trace_shadows(naive, stats, &light, &slot, 1, p, n, &shadow);
+	return shadow;
 }
 
 static inline
@@ -111,12 +649,19 @@ struct material get_material(const struct scene* scene, size_t obj_id) {
 	return vector_get(struct material, scene->materials, material_id);
 }
 
-static v3 get_normal(const struct scene* scene, v3 p, float dist) {
+/* Rays that hit nothing only get the ambient term of the material #0 */
+static inline
+v3 get_sky(const struct scene* scene) {
+	struct material mat = get_material(scene, 0);
+	return v3clamp(v3mul(scene->ambient_color, mat.ambient), 0.f, 1.f);
+}
+
+/* Gradient from four taps on a tetrahedron, h is the footprint of the pixel */
+static v3 get_normal(const struct scene* scene, v3 p, float h) {
 	static const v3 k0 = { 1.f, -1.f, -1.f};
 	static const v3 k1 = {-1.f, -1.f,  1.f};
 	static const v3 k2 = {-1.f,  1.f, -1.f};
 	static const v3 k3 = { 1.f,  1.f,  1.f};
-	const float h = dist / 100.f;
 	const v3 p0 = v3scale(k0, sdf(scene, v3add(p, v3scale(k0, h))).dist);
 	const v3 p1 = v3scale(k1, sdf(scene, v3add(p, v3scale(k1, h))).dist);
 	const v3 p2 = v3scale(k2, sdf(scene, v3add(p, v3scale(k2, h))).dist);
@@ -124,54 +669,293 @@ static v3 get_normal(const struct scene* scene, v3 p, float dist) {
 	return v3normalize(v3add(p0, v3add(p1, v3add(p2, p3))));
 }
 
-/* Basado en el modelo Phong (wiki:Phong_reflection_model) */
+/* Lights with a radius fade out smoothly up to it */
+static inline
+float light_falloff(const struct light* light, v3 p) {
+	if (light->radius <= 0.f)
+		return 1.f;
+
+	v3 rel = v3sub(light->point, p);
+	float ratio = v3dot(rel, rel) / (light->radius * light->radius);
+	ratio = clamp(1.f - ratio, 0.f, 1.f);
+	return ratio * ratio;
+}
+
+/* Upper bound of what a light adds to p (shadows aside), it is 0 when the
+ * surface faces away from it or it's out of reach */
+static inline
+float light_importance(const struct material* mat, const struct light* light,
+	v3 p, v3 n) {
+	v3 rel = v3sub(light->point, p);
+	float incidence = v3dot(n, rel);
+
+	if (incidence <= 0.f)
+		return 0.f;
+
+	v3 terms = v3add(v3mul(light->diffuse_intensity, mat->diffuse),
+	                 v3mul(light->specular_intensity, mat->specular));
+	incidence /= v3len(rel);
+	return maxf(terms.x, maxf(terms.y, terms.z)) * incidence
+	       * light_falloff(light, p);
+}
+
+/* Basado en el modelo Phong (wiki:Phong_reflection_model)
+ * Terms of a single light whose shadow is already known, added to total */
+static inline
+v3 add_light(v3 total_light, const struct scene* scene,
+	const struct material* mat, const struct light* light, v3 p, v3 n,
+	float shadow) {
+	if (light->radius > 0.f)
+		shadow *= light_falloff(light, p);
+
+	v3 cam_pos = scene->camera.point;
+	v3 light_pos = light->point;
+	v3 light_diffuse_intensity = light->diffuse_intensity;
+	v3 light_specular_intensity = light->specular_intensity;
+
+	v3 light_dir = v3normalize(v3sub(light_pos, p));
+	v3 reflected_dir = v3sub(v3scale(n, 2.f * v3dot(light_dir, n)),
+				 light_dir);
+	v3 camera_dir = v3normalize(v3sub(cam_pos, p));
+
+	/* Ajusto la iluminación mate según ángulo y sombra */
+	float diffuse_incidence = clamp(v3dot(n, light_dir), 0.f, 1.f);
+
+	light_diffuse_intensity = v3scale(light_diffuse_intensity,
+	                                  shadow * diffuse_incidence);
+	light_diffuse_intensity = v3mul(light_diffuse_intensity,
+	                                mat->diffuse);
+
+	total_light = v3add(total_light, light_diffuse_intensity);
+
+	/* Ajusto la iluminación especular según ángulo */
+	float specular_incidence = diffuse_incidence * hot_powf(
+		clamp(v3dot(reflected_dir, camera_dir), 0.f, 1.f),
+		mat->shininess
+	);
+
+	light_specular_intensity = v3scale(light_specular_intensity,
+	                                   shadow * specular_incidence);
+	light_specular_intensity = v3mul(light_specular_intensity,
+	                                 mat->specular);
+
+	return v3add(total_light, light_specular_intensity);
+}
+
+static inline
+v3 add_ambient(v3 total_light, const struct scene* scene,
+	const struct material* mat) {
+	v3 light_ambient_intensity = v3mul(scene->ambient_color, mat->ambient);
+
+	/* Unclamped, output_row clamps after the samples are averaged */
+	return v3add(total_light, light_ambient_intensity);
+}
+
+/* Left for the reconstruction by the geometry pass of a checkerboard frame */
+static inline
+bool cb_untraced(const struct naive_data* naive, int x, int y) {
+	return naive->checkerboard && naive->cb_frame
+	       && ((x + y + naive->cb_parity) & 1);
+}
+
+/* Pixel whose hit is the sample i of a shadow map. On checkerboard frames
+ * it's the next one when the middle one isn't traced: with an even scale all
+ * the middles have the same parity. */
+static inline
+size_t shadow_sample_pixel(const struct naive_data* naive,
+	const struct shadow_map* map, int i, int width, int height) {
+	int x = i % map->width * map->scale + map->scale / 2;
+	int y = i / map->width * map->scale + map->scale / 2;
+
+	x = x < width ? x : width - 1;
+	y = y < height ? y : height - 1;
+	if (cb_untraced(naive, x, y) && width > 1)
+		x += x + 1 < width ? 1 : -1;
+	return (size_t) y * width + x;
+}
+
+/* Joint bilateral upsampling of the shadow at pixel (x, y) with hit p and
+ * normal n: bilinear weights of the four closest samples, leaving out the
+ * ones further than tolerance from the tangent plane and scaled down as
+ * their normals diverge. Negative when no sample is on the same surface or
+ * they straddle a sharp shadow edge, those pixels are better traced. */
+static
+float upsample_shadow(const struct shadow_map* map, int x, int y, v3 p, v3 n,
+	float tolerance) {
+	float u = (float) (x - map->scale / 2) / map->scale;
+	float v = (float) (y - map->scale / 2) / map->scale;
+	int x0 = clamp(floorf(u), 0.f, map->width - 1);
+	int y0 = clamp(floorf(v), 0.f, map->height - 1);
+	int x1 = x0 + 1 < map->width ? x0 + 1 : x0;
+	int y1 = y0 + 1 < map->height ? y0 + 1 : y0;
+	float fx = clamp(u - x0, 0.f, 1.f);
+	float fy = clamp(v - y0, 0.f, 1.f);
+	const int idx[4] = {
+		y0 * map->width + x0, y0 * map->width + x1,
+		y1 * map->width + x0, y1 * map->width + x1
+	};
+	const float bilinear[4] = {
+		(1.f - fx) * (1.f - fy), fx * (1.f - fy),
+		(1.f - fx) * fy, fx * fy
+	};
+	float total = 0.f;
+	float weight = 0.f;
+	float lo = 1.f;
+	float hi = 0.f;
+
+	for (int i = 0; i < 4; i++) {
+		float facing = v3dot(n, map->normal[idx[i]]);
+		if (map->shadow[idx[i]] < 0.f || facing <= 0.f)
+			continue;
+		if (fabsf(v3dot(n, v3sub(map->point[idx[i]], p))) > tolerance)
+			continue;
+
+		facing *= facing;
+		facing *= facing;
+		total += bilinear[i] * facing * map->shadow[idx[i]];
+		weight += bilinear[i] * facing;
+		lo = minf(lo, map->shadow[idx[i]]);
+		hi = maxf(hi, map->shadow[idx[i]]);
+	}
+
+	if (weight < 1e-3f || hi - lo > SHADOW_EDGE)
+		return -1.f;
+	return total / weight;
+}
+
+/* Shadow of the light l at the pixel (x, y) with hit p, upsampled from its
+ * shadow map when it has one or else from the cache. Negative when neither
+ * can tell and it has to be traced. */
+static inline
+float stored_shadow(const struct naive_data* naive, struct render_stats* stats,
+	size_t l, v3 p, v3 n, int x, int y, float tolerance) {
+	const struct shadow_map* map = &naive->shadow_maps[l];
+	float shadow = -1.f;
+
+	if (map->scale > 1)
+		shadow = upsample_shadow(map, x, y, p, n,
+		                         tolerance * map->scale);
+	if (shadow < 0.f)
+		shadow = cached_shadow(naive, stats, l, p, n);
+
+	return shadow;
+}
+
+/* Hash of the pixel and frame (lowbias32) to seed random_float */
+static inline
+Uint32 pixel_seed(int x, int y, Uint32 frame) {
+	Uint32 h = (Uint32) x * 0x9e3779b1u ^ (Uint32) y * 0x85ebca77u
+	           ^ frame * 0xc2b2ae3du;
+
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h ? h : 1;
+}
+
+/* Uniform in [0, 1), xorshift32 */
+static inline
+float random_float(Uint32* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return (*state >> 8) * (1.f / 16777216.f);
+}
+
+/* Only the lights in the list (those of the tile of the pixel) can reach p.
+ * The ones facing away or out of reach are skipped and the ones adding less
+ * than light_threshold go unshadowed. With light_samples only that many of
+ * them are picked, by importance, and weighted to keep the expected value. */
 static
-v3 get_light(const struct scene* scene, v3 p, v3 n, size_t obj_id) {
+v3 get_light(const struct naive_data* naive, struct render_stats* stats,
+	v3 p, v3 n, size_t obj_id, int x, int y, float tolerance,
+	const Uint32* list, size_t count) {
+	const struct scene* scene = naive->scene;
+	const struct light* lights = scene->lights->data;
+	const size_t samples = naive->light_samples;
 	struct material mat = get_material(scene, obj_id);
 	v3 total_light = {0.f, 0.f, 0.f};
-	v3 cam_pos = scene->camera.point;
-	
-	/* ... por cada luz ... */
-	vector_foreach(struct light, scene->lights, light) {
-		float shadow = in_shadow(scene, light, p);
+	float total_importance = 0.f;
+	Uint32 rng;
+
+	if (samples == 0 || count <= samples)
+		goto all_lights;
 
-		v3 light_pos = light->point;
-		v3 light_diffuse_intensity = light->diffuse_intensity;
-		v3 light_specular_intensity = light->specular_intensity;
+	for (size_t i = 0; i < count; i++)
+		total_importance += light_importance(&mat, &lights[list[i]],
+		                                     p, n);
 
-		v3 light_dir = v3normalize(v3sub(light_pos, p));
-		v3 reflected_dir = v3sub(v3scale(n, 2.f * v3dot(light_dir, n)),
-					 light_dir);
-		v3 camera_dir = v3normalize(v3sub(cam_pos, p));
+	rng = pixel_seed(x, y, naive->frame);
+	for (size_t s = 0; s < samples && total_importance > 0.f; s++) {
+		float target = random_float(&rng) * total_importance;
+		float importance = 0.f;
+		size_t i = 0;
 
-		/* Ajusto la iluminación mate según ángulo y sombra */
-		float diffuse_incidence = clamp(v3dot(n, light_dir), 0.f, 1.f);
+		for (; i < count; i++) {
+			importance = light_importance(&mat, &lights[list[i]],
+			                              p, n);
+			if (target < importance)
+				break;
+			target -= importance;
+		}
+		/* Rounding left it past the end */
+		if (i == count)
+			continue;
 
-		light_diffuse_intensity = v3scale(light_diffuse_intensity,
-		                                  shadow * diffuse_incidence);
-		light_diffuse_intensity = v3mul(light_diffuse_intensity,
-		                                mat.diffuse);
+		float weight = total_importance / (importance * samples);
+		float shadow = stored_shadow(naive, stats, list[i], p, n, x, y,
+		                             tolerance);
+		Uint32 slot = 0;
+		if (shadow < 0.f)
+			trace_shadows(naive, stats, &list[i], &slot, 1, p, n,
+			              &shadow);
+		total_light = add_light(total_light, scene, &mat,
+		                        &lights[list[i]], p, n,
+		                        shadow * weight);
+	}
 
-		total_light = v3add(total_light, light_diffuse_intensity);
+	return add_ambient(total_light, scene, &mat);
 
-		/* Ajusto la iluminación especular según ángulo */
-		float specular_incidence = diffuse_incidence * powf(
-			clamp(v3dot(reflected_dir, camera_dir), 0.f, 1.f),
-			mat.shininess
-		);
+all_lights:
+	/* ... por cada luz, de SHADOW_LANES en SHADOW_LANES ... */
+	for (size_t i = 0; i < count;) {
+		Uint32 batch[SHADOW_LANES];
+		Uint32 traced[SHADOW_LANES];
+		Uint32 slots[SHADOW_LANES];
+		float shadow[SHADOW_LANES];
+		size_t size = 0;
+		size_t num_traced = 0;
 
-		light_specular_intensity = v3scale(light_specular_intensity,
-		                                   shadow * specular_incidence);
-		light_specular_intensity = v3mul(light_specular_intensity,
-		                                 mat.specular);
+		/* The next lights that add something, the shadows neither the
+		 * maps nor the cache have are traced together */
+		for (; i < count && size < SHADOW_LANES; i++) {
+			const struct light* light = &lights[list[i]];
+			float importance = light_importance(&mat, light, p, n);
 
-		total_light = v3add(total_light, light_specular_intensity);
-	}
+			if (importance <= 0.f)
+				continue;
+			shadow[size] = 1.f;
+			if (importance >= naive->light_threshold)
+				shadow[size] = stored_shadow(naive, stats,
+					list[i], p, n, x, y, tolerance);
+			if (shadow[size] < 0.f) {
+				traced[num_traced] = list[i];
+				slots[num_traced++] = size;
+			}
+			batch[size++] = list[i];
+		}
 
-	v3 light_ambient_intensity = v3mul(scene->ambient_color, mat.ambient);
-	total_light = v3add(total_light, light_ambient_intensity);
+		trace_shadows(naive, stats, traced, slots, num_traced, p, n,
+		              shadow);
+		for (size_t j = 0; j < size; j++)
+			total_light = add_light(total_light, scene, &mat,
+			                        &lights[batch[j]], p, n,
+			                        shadow[j]);
+	}
 
-	return v3clamp(total_light, 0.f, 1.f);
+	return add_ambient(total_light, scene, &mat);
 }
 
 /* Based on https://www.youtube.com/watch?v=LRN_ewuN_k4 */
@@ -180,7 +964,7 @@ v3 get_camera_ray(struct camera cam, v2 view_pos, float aspect_ratio) {
 	/* TODO: Es innecesario calcular todo esto para cada rayo */
 	v3 up_guide = {0.f, 1.f, 0.f};
 	float half_fov = cam.fov / 2.f;
-	float height = atanf(half_fov);
+	float height = hot_atanf(half_fov);
 	float width = aspect_ratio * height;
 	v3 right_dir = v3normalize(v3cross(cam.direction, up_guide));
 	v3 up_dir = v3cross(right_dir, cam.direction);
@@ -192,56 +976,1816 @@ v3 get_camera_ray(struct camera cam, v2 view_pos, float aspect_ratio) {
 	return rval;
 }
 
-int render_thread(void* ptr) {
-	struct render_data* data = ptr;
-	int width;
-	int height;
-	float fwidth;
-	float fheight;
+/* Slopes (x / z) of the two tangents from the origin to the circle of the given
+ * radius centered at (x, z). Only valid when z > radius. */
+static inline
+v2 tangent_slopes(float x, float z, float radius) {
+	float root = radius * sqrtf(x * x + z * z - radius * radius);
+	float den = z * z - radius * radius;
+	return (v2) {(x * z - root) / den, (x * z + root) / den};
+}
 
-	while (true) {
-		SDL_SemWait(frame_entry_barrier);
-		if (SDL_AtomicGet(&exiting))
-			return 0;
+/* Pixel range [lo, hi] (clamped to the screen) whose centers map to view
+ * positions in [from, to] */
+static inline
+bool view_to_pixels(float from, float to, int size, int* lo, int* hi) {
+	/* One pixel of slack for the rounding errors */
+	float pix_from = (from + 1.f) / 2.f * size - 1.5f;
+	float pix_to = (to + 1.f) / 2.f * size + .5f;
 
-		SDL_Surface* surf = data->surf;
-		Uint8 bytes_per_pixel = surf->format->BytesPerPixel;
-		fwidth = width  = surf->w;
-		fheight = height = surf->h;
-		const struct scene* scene = data->scene;
-		v3 ro = scene->camera.point;
-		float aspect_ratio = fwidth / fheight;
+	if (pix_to < 0.f || pix_from > size - 1)
+		return false;
 
-		int y;
-		while ((y = SDL_AtomicAdd(&current_line, 1)) < height)
-		for (int x = 0; x < width; x++) {
-			v2 view_pos = (v2) {
-				(x + .5f) / fwidth * 2.f - 1.f,
-				1.f - (y + .5f) / fheight * 2.f,
-			};
+	*lo = pix_from < 0.f ? 0 : (int) pix_from;
+	*hi = pix_to > size - 1 ? size - 1 : (int) pix_to;
+	return true;
+}
 
-			v3 rd = get_camera_ray(scene->camera, view_pos,
-			                       aspect_ratio);
-			struct world_dist intersect =
-				get_intersection(scene, ro, rd);
-			v3 p = v3add(ro, v3scale(rd, intersect.dist));
-			v3 n = get_normal(scene, p, intersect.dist);
-			v3 colorf = get_light(scene, p, n, intersect.id);
-			/* gamma correction */
-			colorf = v3pow(colorf, 1.f / 2.2f);
-			Uint32 colori = colorf_to_pixfmt(colorf, surf->format);
-			*((Uint32*)(surf->pixels
-			            + x * bytes_per_pixel
-			            + y * surf->pitch)) = colori;
+/* Pixels the bounds can cover seen from the camera (projected the same way
+ * get_camera_ray does), false if none */
+static
+bool project_bounds(const struct camera* cam, struct bounds bounds, int width,
+	int height, int* x0, int* y0, int* x1, int* y1) {
+	const v3 up_guide = {0.f, 1.f, 0.f};
+	float view_height = atanf(cam->fov / 2.f);
+	float view_width = (float) width / height * view_height;
+	v3 right_dir = v3normalize(v3cross(cam->direction, up_guide));
+	v3 up_dir = v3cross(right_dir, cam->direction);
+	v3 rel = v3sub(bounds.center, cam->point);
+	float z = v3dot(rel, cam->direction);
+
+	*x0 = 0, *x1 = width - 1;
+	*y0 = 0, *y1 = height - 1;
+
+	/* Behind the camera */
+	if (z < -bounds.radius)
+		return false;
+
+	/* Fully in front of the camera, otherwise it may cover the whole
+	 * screen */
+	if (z > bounds.radius) {
+		v2 sx = tangent_slopes(v3dot(rel, right_dir), z,
+		                       bounds.radius);
+		v2 sy = tangent_slopes(v3dot(rel, up_dir), z, bounds.radius);
+
+		if (!view_to_pixels(sx.x / view_width, sx.y / view_width,
+		                    width, x0, x1))
+			return false;
+		/* Screen y grows downwards */
+		if (!view_to_pixels(-sy.y / view_height, -sy.x / view_height,
+		                    height, y0, y1))
+			return false;
+	}
+
+	return true;
+}
+
+/* Project every bounds with the camera and add its index to the lists of the
+ * tiles it touches. The ones that would look smaller than min_size are left
+ * out. */
+static
+void bin_bounds(struct tiles* tiles, const struct camera cam,
+	const struct bounds* all_bounds, size_t count, int width, int height,
+	float min_size) {
+	memset(tiles->count, 0,
+	       sizeof(Uint32) * tiles->width * tiles->height);
+
+	for (Uint32 idx = 0; idx < count; idx++) {
+		struct bounds bounds = all_bounds[idx];
+		float z = v3dot(v3sub(bounds.center, cam.point),
+		                cam.direction);
+		int x0, x1, y0, y1;
+
+		/* Smaller than min_size (at distance 1) from here */
+		if (2.f * bounds.radius < z * min_size)
+			continue;
+		if (!project_bounds(&cam, bounds, width, height, &x0, &y0,
+		                    &x1, &y1))
+			continue;
+
+		for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+		for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++) {
+			size_t tile = ty * tiles->width + tx;
+			tiles->items[tile * tiles->capacity
+			             + tiles->count[tile]++] = idx;
 		}
+	}
+}
+
+static
+void gbuffer_resize(struct gbuffer* gbuffer, int width, int height,
+	bool colors) {
+	size_t size = (size_t) width * height;
+
+	if (gbuffer->width == width && gbuffer->height == height)
+		return;
+
+	gbuffer->width = width;
+	gbuffer->height = height;
+	gbuffer->dist = realloc(gbuffer->dist, sizeof(float) * size);
+	gbuffer->id = realloc(gbuffer->id, sizeof(Uint32) * size);
+	gbuffer->normal = realloc(gbuffer->normal, sizeof(v3) * size);
+	if (colors)
+		gbuffer->color = realloc(gbuffer->color, sizeof(v3) * size);
+}
+
+/* Follow the resolution and the lights, the scale of each light comes from
+ * the scene or --shadow-scale */
+static
+void shadow_maps_update(struct naive_data* naive, int width, int height) {
+	const struct scene* scene = naive->scene;
+	size_t num_lights = scene->lights->size;
+	size_t l = 0;
+
+	if (naive->num_shadow_maps != num_lights) {
+		naive->shadow_maps = realloc(naive->shadow_maps,
+			sizeof(struct shadow_map) * num_lights);
+		for (size_t i = naive->num_shadow_maps; i < num_lights; i++)
+			naive->shadow_maps[i] = (struct shadow_map) {0};
+		naive->num_shadow_maps = num_lights;
+	}
+
+	naive->shadow_rows = 0;
+	vector_foreach(struct light, scene->lights, light) {
+		struct shadow_map* map = &naive->shadow_maps[l++];
+		int scale = light->shadow_scale >= 1.f ? light->shadow_scale
+		                                       : naive->shadow_scale;
+		int map_width = (width + scale - 1) / scale;
+		int map_height = (height + scale - 1) / scale;
+		size_t size = (size_t) map_width * map_height;
 
-		SDL_SemPost(frame_exit_barrier);
+		if (scale > 1)
+			naive->shadow_rows += map_height;
+		if (map->scale == scale && map->width == map_width
+		    && map->height == map_height)
+			continue;
+
+		map->scale = scale;
+		map->width = map_width;
+		map->height = map_height;
+		map->shadow = realloc(map->shadow, sizeof(float) * size);
+		map->point = realloc(map->point, sizeof(v3) * size);
+		map->normal = realloc(map->normal, sizeof(v3) * size);
 	}
+
+	SDL_AtomicSet(&naive->shadow_line, 0);
 }
 
-void render_prepare(struct render_data* scene, int argc, const char* argv[]) {
-	scene->private = NULL;
+static
+void tiles_resize(struct tiles* tiles, int width, int height,
+	size_t capacity) {
+	width = (width + TILE_SIZE - 1) / TILE_SIZE;
+	height = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	if (tiles->width == width && tiles->height == height
+	    && tiles->capacity == capacity)
+		return;
+
+	tiles->width = width;
+	tiles->height = height;
+	tiles->capacity = capacity;
+	tiles->count = realloc(tiles->count,
+	                       sizeof(Uint32) * width * height);
+	tiles->items = realloc(tiles->items,
+	                         sizeof(Uint32) * width * height * capacity);
 }
 
-void render_destroy(struct render_data* scene) {
+/* Adds a traced row to the accumulated samples and leaves their average in
+ * it. The first sample is stored as is, so a single one is output unchanged */
+static inline
+void accumulate_row(const struct naive_data* naive, int y, v3* row,
+	int width) {
+	v3* accum = naive->accum + (size_t) y * width;
+	float scale = 1.f / naive->samples;
+
+	if (!naive->max_samples)
+		return;
+
+	if (naive->samples == 1) {
+		memcpy(accum, row, sizeof(v3) * width);
+		return;
+	}
+
+	for (int x = 0; x < width; x++) {
+		accum[x] = v3add(accum[x], row[x]);
+		row[x] = v3scale(accum[x], scale);
+	}
+}
+
+/* Tints the tiles of the last rate pass, 2x2 yellow and 4x4 blue */
+static
+void vrs_overlay_row(const struct naive_data* naive, int y, v3* row,
+	int width) {
+	const Uint8* rate = naive->vrs_rate + y / VRS_TILE * naive->vrs_width;
+	const v3 tint2 = {.5f, .4f, 0.f};
+	const v3 tint4 = {0.f, .2f, .5f};
+
+	for (int x = 0; x < width; x++)
+		if (rate[x / VRS_TILE] > 1)
+			row[x] = v3add(v3scale(row[x], .5f),
+			               rate[x / VRS_TILE] == 2 ? tint2 : tint4);
+}
+
+/* The last pass of the deferred mode puts its rows on the surface through
+ * here, the overlay isn't part of the samples */
+static
+void output_frame_row(const struct naive_data* naive, int y, v3* row,
+	SDL_Surface* surf) {
+	accumulate_row(naive, y, row, surf->w);
+	if (naive->last)
+		memcpy(naive->last + (size_t) y * surf->w, row,
+		       sizeof(v3) * surf->w);
+	if (naive->vrs_overlay && naive->vrs_frame)
+		vrs_overlay_row(naive, y, row, surf->w);
+	output_row(&naive->output, surf, y, row, surf->w);
+}
+
+/* Radical inverse of i in the given base, in [0, 1) */
+static inline
+float halton(Uint32 i, Uint32 base) {
+	float f = 1.f;
+	float rval = 0.f;
+
+	while (i) {
+		f /= base;
+		rval += f * (i % base);
+		i /= base;
+	}
+	return rval;
+}
+
+/* View position of the center of pixel (x, y), moved by any fraction */
+static inline
+v2 pixel_to_view(float x, float y, float width, float height) {
+	return (v2) {
+		(x + .5f) / width * 2.f - 1.f,
+		1.f - (y + .5f) / height * 2.f,
+	};
+}
+
+
+static
+void wavefront_resize(struct wavefront* wf, size_t capacity,
+	size_t num_lights) {
+	if (wf->capacity == capacity && wf->num_lights == num_lights)
+		return;
+
+	wf->capacity = capacity;
+	wf->num_lights = num_lights;
+	wf->pixel = realloc(wf->pixel, sizeof(Uint32) * capacity);
+	wf->dir = realloc(wf->dir, sizeof(v3) * capacity);
+	wf->dist = realloc(wf->dist, sizeof(float) * capacity);
+	wf->id = realloc(wf->id, sizeof(Uint32) * capacity);
+	wf->normal = realloc(wf->normal, sizeof(v3) * capacity);
+	wf->shadow = realloc(wf->shadow,
+	                     sizeof(float) * capacity * num_lights);
+	wf->weight = realloc(wf->weight,
+	                     sizeof(float) * capacity * num_lights);
+}
+
+static
+void wavefront_free(struct wavefront* wf) {
+	free(wf->pixel);
+	free(wf->dir);
+	free(wf->dist);
+	free(wf->id);
+	free(wf->normal);
+	free(wf->shadow);
+	free(wf->weight);
+}
+
+/* Time spent in a stage and rays that went in */
+static inline
+void stage_done(struct render_stats* stats, enum render_stage stage,
+	Uint64* start, size_t rays) {
+	Uint64 now = SDL_GetPerformanceCounter();
+
+	stats->stage_items[stage] += rays;
+	stats->stage_time[stage] += now - *start;
+	*start = now;
+}
+
+/* Shadows of the light l at the hits of the listed rays of the queue, traced
+ * SHADOW_LANES rays at a time. With bricks each goes through in_shadow, their
+ * near bound is per lane. They end up in wf->shadow and the cache. */
+static
+void trace_light_shadows(const struct naive_data* naive,
+	struct render_stats* stats, struct wavefront* wf, Uint32 l,
+	const Uint32* rays, size_t count, v3 ro) {
+	const struct light* lights = naive->scene->lights->data;
+	const struct light* light = &lights[l];
+	v3 p[SHADOW_LANES];
+	v3 rd[SHADOW_LANES];
+	v3 sro[SHADOW_LANES];
+	float max_dist[SHADOW_LANES];
+	float res[SHADOW_LANES];
+
+	if (!count)
+		return;
+
+	for (size_t i = 0; i < count; i++) {
+		p[i] = v3add(ro, v3scale(wf->dir[rays[i]], wf->dist[rays[i]]));
+		if (naive->bricks) {
+			res[i] = in_shadow(naive, stats, light, p[i]);
+			continue;
+		}
+		/* The same rays in_shadow traces */
+		max_dist[i] = v3len(v3sub(light->point, p[i]));
+		rd[i] = v3normalize(v3sub(light->point, p[i]));
+		sro[i] = v3add(p[i], rd[i]);
+	}
+	if (!naive->bricks)
+		softshadow8(naive->scene, stats, sro, rd, max_dist, count,
+		            SHADOW_STEPS, SHADOW_SHARPNESS, res);
+
+	for (size_t i = 0; i < count; i++) {
+		wf->shadow[rays[i] * wf->num_lights + l] = res[i];
+		if (naive->shadow_cache)
+			shadow_cache_insert(naive->shadow_cache, l, p[i],
+			                    wf->normal[rays[i]], res[i]);
+	}
+}
+
+/* The lights get_light would use at the hit of the ray i, for the pixel
+ * (x, y): those of its tile, by light_threshold and light_samples. Each gets
+ * its weight and its shadow from the cache, or 1 under the threshold and
+ * negative to trace. Returns how many were looked up. */
+static
+size_t wavefront_lights(const struct naive_data* naive,
+	struct render_stats* stats, struct wavefront* wf, size_t i, int x,
+	int y, v3 ro) {
+	const struct scene* scene = naive->scene;
+	const struct light* lights = scene->lights->data;
+	const struct tiles* tiles = &naive->light_tiles;
+	const size_t tile = y / TILE_SIZE * tiles->width + x / TILE_SIZE;
+	const Uint32* list = tiles->items + tile * tiles->capacity;
+	const size_t count = tiles->count[tile];
+	const size_t samples = naive->light_samples;
+	const struct material mat = get_material(scene, wf->id[i]);
+	float* shadow = &wf->shadow[i * wf->num_lights];
+	float* weight = &wf->weight[i * wf->num_lights];
+	v3 p = v3add(ro, v3scale(wf->dir[i], wf->dist[i]));
+	v3 n = wf->normal[i];
+	float total_importance = 0.f;
+	size_t looked_up = 0;
+	Uint32 rng;
+
+	memset(shadow, 0, sizeof(float) * wf->num_lights);
+	memset(weight, 0, sizeof(float) * wf->num_lights);
+
+	if (samples == 0 || count <= samples) {
+		for (size_t j = 0; j < count; j++) {
+			float importance = light_importance(&mat,
+				&lights[list[j]], p, n);
+
+			if (importance <= 0.f)
+				continue;
+			weight[list[j]] = shadow[list[j]] = 1.f;
+			if (importance < naive->light_threshold)
+				continue;
+			shadow[list[j]] = cached_shadow(naive, stats, list[j],
+			                                p, n);
+			looked_up++;
+		}
+		return looked_up;
+	}
+
+	for (size_t j = 0; j < count; j++)
+		total_importance += light_importance(&mat, &lights[list[j]],
+		                                     p, n);
+
+	/* The picks of get_light, a light picked again adds to its weight */
+	rng = pixel_seed(x, y, naive->frame);
+	for (size_t s = 0; s < samples && total_importance > 0.f; s++) {
+		float target = random_float(&rng) * total_importance;
+		float importance = 0.f;
+		size_t j = 0;
+
+		for (; j < count; j++) {
+			importance = light_importance(&mat, &lights[list[j]],
+			                              p, n);
+			if (target < importance)
+				break;
+			target -= importance;
+		}
+		if (j == count)
+			continue;
+
+		if (weight[list[j]] == 0.f) {
+			shadow[list[j]] = cached_shadow(naive, stats, list[j],
+			                                p, n);
+			looked_up++;
+		}
+		weight[list[j]] += total_importance / (importance * samples);
+	}
+
+	return looked_up;
+}
+
+/* Wavefront mode: each row goes through the stages as a batch, so every loop
+ * runs a single kind of work over the rays that are still alive. Misses
+ * leave after the march and the surfaces facing away from a light don't
+ * trace its shadow. The generate, march and shadow stages take the rays
+ * eight at a time in AVX lanes, without bricks. */
+static
+void render_wavefront(const struct naive_data* naive, struct wavefront* wf,
+	struct render_stats* stats, struct span* spans, v3* row,
+	SDL_Surface* surf) {
+	const struct scene* scene = naive->scene;
+	const struct tiles* tiles = &naive->tiles;
+	const struct light* lights = scene->lights->data;
+	const size_t num_lights = scene->lights->size;
+	const int width = surf->w;
+	const int height = surf->h;
+	const float fwidth = width;
+	const float fheight = height;
+	const float aspect_ratio = fwidth / fheight;
+	const v3 ro = scene->camera.point;
+	const v3 sky = get_sky(scene);
+	const v2 jitter = naive->jitter;
+	const v3 up_guide = {0.f, 1.f, 0.f};
+	const float view_height = hot_atanf(scene->camera.fov / 2.f);
+	const float view_width = aspect_ratio * view_height;
+	const v3 right_dir = v3normalize(v3cross(scene->camera.direction,
+	                                         up_guide));
+	const v3 up_dir = v3cross(right_dir, scene->camera.direction);
+	int y;
+
+	wavefront_resize(wf, width, num_lights);
+
+	while ((y = SDL_AtomicAdd(&current_line, 1)) < height) {
+		Uint64 start = SDL_GetPerformanceCounter();
+		size_t count = width;
+		size_t live = 0;
+
+		/* get_camera_ray, eight pixels at a time */
+		float view_y = pixel_to_view(0.f, y + jitter.y, fwidth,
+		                             fheight).y;
+		v3x8 up = v3x8fill(v3scale(up_dir, view_y * view_height));
+		for (int x = 0; x < width; x += 8) {
+			__m256 view_x = _mm256_cvtepi32_ps(_mm256_add_epi32(
+				_mm256_set1_epi32(x),
+				_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+			view_x = _mm256_add_ps(_mm256_add_ps(view_x,
+				_mm256_set1_ps(jitter.x)), _mm256_set1_ps(.5f));
+			view_x = _mm256_sub_ps(_mm256_mul_ps(_mm256_div_ps(
+				view_x, _mm256_set1_ps(fwidth)),
+				_mm256_set1_ps(2.f)), _mm256_set1_ps(1.f));
+			v3x8 dir = v3x8scale(v3x8fill(right_dir), _mm256_mul_ps(
+				view_x, _mm256_set1_ps(view_width)));
+
+			dir = v3x8add(v3x8add(dir, up),
+			              v3x8fill(scene->camera.direction));
+			v3x8store(wf->dir + x, v3x8normalize(dir), width - x);
+		}
+		stage_done(stats, STAGE_GENERATE, &start, count);
+
+		/* The whole row goes in, eight pixels never straddle a tile */
+		for (size_t i = 0; i < count; i += 8) {
+			size_t lanes = count - i < 8 ? count - i : 8;
+			size_t tile = y / TILE_SIZE * tiles->width
+			            + i / TILE_SIZE;
+			const Uint32* list = tiles->items
+			                     + tile * tiles->capacity;
+			size_t num = tiles->count[tile];
+			struct world_dist intersect[8];
+
+			if (naive->bricks) {
+				for (size_t j = 0; j < lanes; j++)
+					intersect[j] = get_intersection(naive,
+						stats, list, num, spans, ro,
+						wf->dir[i + j]);
+			} else {
+				get_intersection8(naive, stats, list, num, ro,
+					wf->dir + i, lanes, intersect);
+			}
+
+			for (size_t j = 0; j < lanes; j++) {
+				if (!intersect[j].id) {
+					row[i + j] = sky;
+					continue;
+				}
+
+				wf->pixel[live] = i + j;
+				wf->dir[live] = wf->dir[i + j];
+				wf->dist[live] = intersect[j].dist;
+				wf->id[live++] = intersect[j].id;
+			}
+		}
+		stage_done(stats, STAGE_MARCH, &start, count);
+		count = live;
+
+		for (size_t i = 0; i < count; i++) {
+			float h = footprint(naive, wf->dist[i]);
+			v3 p = v3add(ro, v3scale(wf->dir[i], wf->dist[i]));
+			wf->normal[i] = get_normal(scene, p, h);
+		}
+		stage_done(stats, STAGE_NORMAL, &start, count);
+
+		/* The lights facing away, out of reach or not picked only
+		 * leave the ambient term. Negative are left to trace. */
+		live = 0;
+		for (size_t i = 0; i < count; i++)
+			live += wavefront_lights(naive, stats, wf, i,
+			                         wf->pixel[i], y, ro);
+
+		/* Then light by light, the rays go SHADOW_LANES at a time */
+		for (size_t l = 0; l < num_lights; l++) {
+			Uint32 rays[SHADOW_LANES];
+			size_t num_rays = 0;
+
+			for (size_t i = 0; i < count; i++) {
+				if (wf->shadow[i * num_lights + l] >= 0.f)
+					continue;
+				rays[num_rays++] = i;
+				if (num_rays < SHADOW_LANES)
+					continue;
+				trace_light_shadows(naive, stats, wf, l, rays,
+				                    num_rays, ro);
+				num_rays = 0;
+			}
+			trace_light_shadows(naive, stats, wf, l, rays,
+			                    num_rays, ro);
+		}
+		stage_done(stats, STAGE_SHADOW, &start, live);
+
+		for (size_t i = 0; i < count; i++) {
+			struct material mat = get_material(scene, wf->id[i]);
+			const float* shadow = &wf->shadow[i * num_lights];
+			const float* weight = &wf->weight[i * num_lights];
+			v3 p = v3add(ro, v3scale(wf->dir[i], wf->dist[i]));
+			v3 colorf = {0.f, 0.f, 0.f};
+
+			for (size_t l = 0; l < num_lights; l++)
+				if (weight[l] > 0.f)
+					colorf = add_light(colorf, scene, &mat,
+						&lights[l], p, wf->normal[i],
+						shadow[l] * weight[l]);
+			row[wf->pixel[i]] = add_ambient(colorf, scene, &mat);
+		}
+		stage_done(stats, STAGE_SHADE, &start, count);
+
+		accumulate_row(naive, y, row, width);
+		output_row(&naive->output, surf, y, row, width);
+	}
+}
+
+/* Whether this frame draws the pixel, partial ones keep the last colors of the
+ * clean tiles */
+static inline
+bool dirty_pixel(const struct naive_data* naive, int x, int y) {
+	return !naive->partial
+	       || naive->dirty[y / TILE_SIZE * naive->tiles.width
+	                       + x / TILE_SIZE];
+}
+
+/* Traces the samples of the shadow maps with scale > 1 from the G-buffer, the
+ * rows of all of them are handed out together */
+static
+void shadow_pass(struct naive_data* naive, struct render_stats* stats,
+	int width, int height) {
+	const struct scene* scene = naive->scene;
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const float aspect_ratio = (float) width / height;
+	const v3 ro = scene->camera.point;
+	const v2 jitter = naive->jitter;
+	int row;
+
+	while ((row = SDL_AtomicAdd(&naive->shadow_line, 1))
+	       < naive->shadow_rows) {
+		size_t l = 0;
+		for (;; l++) {
+			if (naive->shadow_maps[l].scale <= 1)
+				continue;
+			if (row < naive->shadow_maps[l].height)
+				break;
+			row -= naive->shadow_maps[l].height;
+		}
+
+		struct shadow_map* map = &naive->shadow_maps[l];
+		for (int i = row * map->width; i < (row + 1) * map->width;
+		     i++) {
+			size_t pixel = shadow_sample_pixel(naive, map, i,
+			                                   width, height);
+			/* The clean tiles keep theirs */
+			if (!dirty_pixel(naive, pixel % width, pixel / width))
+				continue;
+			if (!gbuffer->id[pixel]) {
+				map->shadow[i] = -1.f;
+				continue;
+			}
+
+			/* The ray the G-buffer has, jittered the same */
+			v2 view_pos = pixel_to_view(pixel % width + jitter.x,
+			                            pixel / width + jitter.y,
+			                            width, height);
+			v3 rd = get_camera_ray(scene->camera, view_pos,
+			                       aspect_ratio);
+			float dist = gbuffer->dist[pixel];
+			map->point[i] = v3add(ro, v3scale(rd, dist));
+			map->normal[i] = gbuffer->normal[pixel];
+			map->shadow[i] = trace_shadow(naive, stats, l,
+			                              map->point[i],
+			                              map->normal[i]);
+		}
+	}
+}
+
+/* Lights the hit of the pixel (x, y) in the G-buffer */
+static inline
+v3 shade_pixel(const struct naive_data* naive, struct render_stats* stats,
+	int x, int y, int width, int height) {
+	const struct scene* scene = naive->scene;
+	const struct tiles* lights = &naive->light_tiles;
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const size_t pixel = (size_t) y * width + x;
+	const size_t tile = y / TILE_SIZE * lights->width + x / TILE_SIZE;
+	const float dist = gbuffer->dist[pixel];
+	v2 view_pos = pixel_to_view(x + naive->jitter.x, y + naive->jitter.y,
+	                            width, height);
+	v3 rd = get_camera_ray(scene->camera, view_pos, (float) width / height);
+	v3 p = v3add(scene->camera.point, v3scale(rd, dist));
+
+	return get_light(naive, stats, p, gbuffer->normal[pixel],
+	                 gbuffer->id[pixel], x, y,
+	                 2.f * footprint(naive, dist),
+	                 lights->items + tile * lights->capacity,
+	                 lights->count[tile]);
+}
+
+/* Perceived brightness, the square root stands in for the gamma */
+static inline
+float aa_brightness(v3 c) {
+	c = v3clamp(c, 0.f, 1.f);
+	return sqrtf(.299f * c.x + .587f * c.y + .114f * c.z);
+}
+
+static
+bool aa_edge(const struct gbuffer* gbuffer, int x, int y) {
+	static const int dx[4] = {-1, 1, 0, 0};
+	static const int dy[4] = {0, 0, -1, 1};
+	const int width = gbuffer->width;
+	const size_t pixel = (size_t) y * width + x;
+	const Uint32 id = gbuffer->id[pixel];
+	float lo = aa_brightness(gbuffer->color[pixel]);
+	float hi = lo;
+
+	for (int i = 0; i < 4; i++) {
+		int nx = x + dx[i];
+		int ny = y + dy[i];
+		if (nx < 0 || ny < 0 || nx >= width || ny >= gbuffer->height)
+			continue;
+
+		size_t other = (size_t) ny * width + nx;
+		if (gbuffer->id[other] != id)
+			return true;
+		if (id && v3dot(gbuffer->normal[other], gbuffer->normal[pixel])
+		          < AA_NORMAL_COS)
+			return true;
+
+		float b = aa_brightness(gbuffer->color[other]);
+		lo = minf(lo, b);
+		hi = maxf(hi, b);
+	}
+
+	return hi - lo > AA_CONTRAST;
+}
+
+/* Color through the point (px, py) of pixel (x, y), both passes at once */
+static
+v3 trace_sample(const struct naive_data* naive, struct render_stats* stats,
+	struct span* spans, int x, int y, float px, float py, int width,
+	int height) {
+	const struct scene* scene = naive->scene;
+	const struct tiles* tiles = &naive->tiles;
+	const struct tiles* lights = &naive->light_tiles;
+	const v3 ro = scene->camera.point;
+	size_t tile = y / TILE_SIZE * tiles->width + x / TILE_SIZE;
+	size_t light_tile = y / TILE_SIZE * lights->width + x / TILE_SIZE;
+	v2 view_pos = pixel_to_view(px, py, width, height);
+	v3 rd = get_camera_ray(scene->camera, view_pos,
+	                       (float) width / height);
+	struct world_dist intersect = get_intersection(naive, stats,
+		tiles->items + tile * tiles->capacity, tiles->count[tile],
+		spans, ro, rd);
+
+	if (!intersect.id)
+		return get_sky(scene);
+
+	float h = footprint(naive, intersect.dist);
+	v3 p = v3add(ro, v3scale(rd, intersect.dist));
+	return get_light(naive, stats, p, get_normal(scene, p, h),
+	                 intersect.id, x, y, 2.f * h,
+	                 lights->items + light_tile * lights->capacity,
+	                 lights->count[light_tile]);
+}
+
+/* Once every row has its count of edge pixels, the last one to finish sees
+ * how far the budget of the frame goes: first with fewer samples for all of
+ * them, down to 2, then with only a fraction of them. Each row is left with
+ * the edge pixels before it. */
+static
+void aa_plan(struct naive_data* naive, int height) {
+	int edges = 0;
+
+	for (int y = 0; y < height; y++) {
+		int count = naive->aa_edges[y];
+		naive->aa_edges[y] = edges;
+		edges += count;
+	}
+
+	naive->aa_extra = naive->aa_samples - 1;
+	naive->aa_ratio = 1.f;
+	if ((Sint64) edges * naive->aa_extra <= naive->aa_rays_max)
+		return;
+
+	naive->aa_extra = naive->aa_rays_max / edges;
+	if (naive->aa_extra < 1) {
+		naive->aa_extra = 1;
+		naive->aa_ratio = (float) naive->aa_rays_max / edges;
+	}
+}
+
+/* Whether the edge pixel i is one of the fraction traced this frame, they are
+ * spread evenly over all of them and the phase moves them from frame to
+ * frame */
+static inline
+bool aa_picked(float ratio, float phase, int i) {
+	return floorf((i + 1) * ratio + phase) > floorf(i * ratio + phase);
+}
+
+/* Adaptive anti-aliasing, after the lighting pass: the pixels on an edge get
+ * up to aa_samples over the pixel (the first one is the lit sample), as many
+ * as the rays budgeted for the frame allow, the rest keep their single
+ * sample. The edges are counted first so the budget reaches the whole
+ * frame. */
+static
+void aa_pass(struct naive_data* naive, struct render_stats* stats,
+	struct span* spans, v3* row, SDL_Surface* surf) {
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const int width = surf->w;
+	const int height = surf->h;
+	const float phase = halton(naive->frame, 2);
+	const v2 jitter = naive->jitter;
+	int y;
+
+	while ((y = SDL_AtomicAdd(&naive->aa_line, 1)) < height) {
+		int edges = 0;
+
+		for (int x = 0; x < width; x++)
+			edges += dirty_pixel(naive, x, y)
+			         && aa_edge(gbuffer, x, y);
+		naive->aa_edges[y] = edges;
+		if (SDL_AtomicAdd(&naive->aa_counted, 1) == height - 1)
+			aa_plan(naive, height);
+	}
+
+	barrier_wait(&naive->barrier);
+
+	const int extra = naive->aa_extra;
+	const float scale = 1.f / (extra + 1);
+
+	while ((y = SDL_AtomicAdd(&naive->aa_trace_line, 1)) < height) {
+		const v3* color = gbuffer->color + (size_t) y * width;
+		int edge = naive->aa_edges[y];
+
+		for (int x = 0; x < width; x++) {
+			row[x] = color[x];
+			if (!dirty_pixel(naive, x, y)
+			    || !aa_edge(gbuffer, x, y)
+			    || !aa_picked(naive->aa_ratio, phase, edge++))
+				continue;
+
+			v3 sum = color[x];
+			for (int i = 1; i <= extra; i++)
+				sum = v3add(sum, trace_sample(naive, stats,
+					spans, x, y,
+					x + jitter.x + halton(i, 2) - .5f,
+					y + jitter.y + halton(i, 3) - .5f,
+					width, height));
+			row[x] = v3scale(sum, scale);
+			stats->count[STAT_AA_PIXELS]++;
+			stats->count[STAT_AA_RAYS] += extra;
+		}
+		output_frame_row(naive, y, row, surf);
+	}
+}
+
+/* Where the camera (same size and aspect ratio as this frame) sees p, in
+ * pixels with the centers on whole numbers. False if it's behind. */
+static
+bool reproject(const struct camera* cam, v3 p, int width, int height,
+	float* x, float* y) {
+	const v3 up_guide = {0.f, 1.f, 0.f};
+	float view_height = atanf(cam->fov / 2.f);
+	float view_width = (float) width / height * view_height;
+	v3 right_dir = v3normalize(v3cross(cam->direction, up_guide));
+	v3 up_dir = v3cross(right_dir, cam->direction);
+	v3 d = v3sub(p, cam->point);
+	float z = v3dot(d, cam->direction);
+
+	if (z <= 0.f)
+		return false;
+
+	float vx = v3dot(d, right_dir) / (z * view_width);
+	float vy = v3dot(d, up_dir) / (z * view_height);
+	*x = (vx + 1.f) * .5f * width - .5f;
+	*y = (1.f - vy) * .5f * height - .5f;
+	return true;
+}
+
+/* Bilinear filtered color of the history at (x, y), from the pixels that saw
+ * the same object at the same distance. False if none did. */
+static
+bool history_sample(const struct history* history, float x, float y,
+	Uint32 id, float dist, v3* color) {
+	const int width = history->width;
+	const int height = history->height;
+	int x0 = floorf(x);
+	int y0 = floorf(y);
+	float tx = x - x0;
+	float ty = y - y0;
+	v3 sum = {0.f, 0.f, 0.f};
+	float total = 0.f;
+
+	for (int i = 0; i < 4; i++) {
+		int hx = x0 + (i & 1);
+		int hy = y0 + (i >> 1);
+		float w = (i & 1 ? tx : 1.f - tx) * (i >> 1 ? ty : 1.f - ty);
+		if (hx < 0 || hy < 0 || hx >= width || hy >= height || w <= 0.f)
+			continue;
+
+		size_t past = (size_t) hy * width + hx;
+		if (history->id[past] != id
+		    || (id && fabsf(history->dist[past] - dist)
+		              > CB_DEPTH_TOLERANCE * dist))
+			continue;
+
+		sum = v3add(sum, v3scale(history->color[past], w));
+		total += w;
+	}
+
+	if (total <= 0.f)
+		return false;
+	*color = v3scale(sum, 1.f / total);
+	return true;
+}
+
+/* An untraced pixel of a checkerboard frame. Each traced neighbour's hit (or
+ * miss) is a guess at what it sees, the first one that lands on the same
+ * object at the same distance in the last frame gives its color. Without
+ * one (a disocclusion, or no last frame) it gets the average of the
+ * neighbours. It takes the rest of its G-buffer entry from the neighbour it
+ * went with, or from the nearest one. */
+static
+void reconstruct_pixel(const struct naive_data* naive,
+	struct render_stats* stats, int x, int y, v3 rd) {
+	static const int dx[4] = {-1, 1, 0, 0};
+	static const int dy[4] = {0, 0, -1, 1};
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const struct history* history = &naive->history;
+	const int width = gbuffer->width;
+	const int height = gbuffer->height;
+	const v3 ro = naive->scene->camera.point;
+	const size_t pixel = (size_t) y * width + x;
+	v3 sum = {0.f, 0.f, 0.f};
+	v3 lo = {INFINITY, INFINITY, INFINITY};
+	v3 hi = {0.f, 0.f, 0.f};
+	size_t nearest = pixel;
+	size_t from = pixel;	/* The guess that held */
+	v3 past;
+	int count = 0;
+
+	for (int i = 0; i < 4; i++) {
+		int nx = x + dx[i];
+		int ny = y + dy[i];
+		float hx, hy;
+		if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+			continue;
+
+		size_t other = (size_t) ny * width + nx;
+		Uint32 id = gbuffer->id[other];
+		v3 p = v3add(ro, v3scale(rd, gbuffer->dist[other]));
+		sum = v3add(sum, gbuffer->color[other]);
+		lo = v3min(lo, gbuffer->color[other]);
+		hi = v3max(hi, gbuffer->color[other]);
+		count++;
+
+		if (nearest == pixel
+		    || gbuffer->dist[other] < gbuffer->dist[nearest])
+			nearest = other;
+
+		if (from == pixel && history->valid
+		    && reproject(&history->camera, p, width, height, &hx, &hy)
+		    && history_sample(history, hx, hy, id,
+		                      v3len(v3sub(p, history->camera.point)),
+		                      &past))
+			from = other;
+	}
+
+	/* Clamped to the neighbours, so what changed since doesn't linger */
+	if (from != pixel) {
+		gbuffer->color[pixel] = v3min(v3max(past, lo), hi);
+		stats->count[STAT_CB_REPROJECTED]++;
+	} else {
+		gbuffer->color[pixel] = v3scale(sum, 1.f / count);
+		stats->count[STAT_CB_FILLED]++;
+		from = nearest;
+	}
+	gbuffer->id[pixel] = gbuffer->id[from];
+	gbuffer->dist[pixel] = gbuffer->dist[from];
+	gbuffer->normal[pixel] = gbuffer->normal[from];
+}
+
+/* Fills the pixels a checkerboard frame didn't trace. The neighbours it reads
+ * were all traced, so rows can go in any order and, unless the AA pass
+ * follows, straight to the surface. */
+static
+void reconstruct_pass(struct naive_data* naive, struct render_stats* stats,
+	v3* row, SDL_Surface* surf, bool output) {
+	const struct scene* scene = naive->scene;
+	const int width = surf->w;
+	const int height = surf->h;
+	const float aspect_ratio = (float) width / height;
+	const v2 jitter = naive->jitter;
+	int y;
+
+	while ((y = SDL_AtomicAdd(&naive->cb_line, 1)) < height) {
+		Uint64 start = SDL_GetPerformanceCounter();
+		v3* color = naive->gbuffer.color + (size_t) y * width;
+		int x = (y + naive->cb_parity + 1) & 1;
+
+		for (; x < width; x += 2) {
+			v2 view_pos = pixel_to_view(x + jitter.x,
+			                            y + jitter.y, width,
+			                            height);
+			v3 rd = get_camera_ray(scene->camera, view_pos,
+			                       aspect_ratio);
+			reconstruct_pixel(naive, stats, x, y, rd);
+		}
+		stage_done(stats, STAGE_RECONSTRUCT, &start, width / 2);
+
+		if (!output)
+			continue;
+		memcpy(row, color, sizeof(v3) * width);
+		output_frame_row(naive, y, row, surf);
+	}
+}
+
+/* Whether the lighting pass shades (x, y) in a tile at the given rate. The
+ * samples of all rates are on the same grid, shifted to the traced pixels
+ * in checkerboard frames. */
+static inline
+bool vrs_sample(const struct naive_data* naive, int rate, int x, int y) {
+	return (x - naive->vrs_origin) % rate == 0 && y % rate == 0;
+}
+
+static inline
+int vrs_rate_at(const struct naive_data* naive, int x, int y) {
+	return naive->vrs_rate[y / VRS_TILE * naive->vrs_width + x / VRS_TILE];
+}
+
+/* Rate of a tile from the G-buffer and the colors of the last frame, all of
+ * it shaded while there are none */
+static
+int vrs_tile_rate(const struct naive_data* naive, int tx, int ty) {
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const v3* colors = naive->vrs_colors;
+	const int width = gbuffer->width;
+	const int x0 = tx * VRS_TILE;
+	const int y0 = ty * VRS_TILE;
+	const int x1 = x0 + VRS_TILE < width ? x0 + VRS_TILE : width;
+	const int y1 = y0 + VRS_TILE < gbuffer->height ? y0 + VRS_TILE
+	                                                : gbuffer->height;
+	v3 normals = {0.f, 0.f, 0.f};
+	Uint32 id = 0;
+	bool single = true;
+	int hits = 0;
+	float contrast = 0.f;
+
+	for (int y = y0; y < y1; y++)
+	for (int x = x0; x < x1; x++) {
+		size_t pixel = (size_t) y * width + x;
+		if (!gbuffer->id[pixel] || cb_untraced(naive, x, y))
+			continue;
+
+		single = single && (!hits || gbuffer->id[pixel] == id);
+		id = gbuffer->id[pixel];
+		normals = v3add(normals, gbuffer->normal[pixel]);
+		hits++;
+	}
+	/* Nothing to light */
+	if (!hits)
+		return 4;
+	if (!colors)
+		return 1;
+
+	for (int y = y0; y < y1; y++)
+	for (int x = x0; x < x1; x++) {
+		size_t pixel = (size_t) y * width + x;
+		float b = aa_brightness(colors[pixel]);
+		if (x + 1 < x1)
+			contrast = maxf(contrast, fabsf(b - aa_brightness(
+				colors[pixel + 1])));
+		if (y + 1 < y1)
+			contrast = maxf(contrast, fabsf(b - aa_brightness(
+				colors[pixel + width])));
+	}
+
+	float spread = 1.f - v3len(normals) / hits;
+	if (spread > VRS_NORMAL_SPREAD || contrast > VRS_CONTRAST)
+		return 1;
+	if (!single || spread > VRS_NORMAL_SPREAD / 4.f
+	    || contrast > VRS_CONTRAST / 4.f)
+		return 2;
+	return 4;
+}
+
+/* Picks the rates of the tiles, a row of tiles at a time */
+static
+void vrs_rate_pass(struct naive_data* naive) {
+	int ty;
+
+	while ((ty = SDL_AtomicAdd(&naive->vrs_line, 1)) < naive->vrs_height)
+		for (int tx = 0; tx < naive->vrs_width; tx++)
+			naive->vrs_rate[ty * naive->vrs_width + tx] =
+				vrs_tile_rate(naive, tx, ty);
+}
+
+/* Color of a pixel the lighting pass skipped, from the samples around it
+ * that see the same object: bilinear weights scaled down as the normals
+ * diverge, like the shadow upsampling. False when none do, or when they
+ * straddle an edge the last frame didn't have here. */
+static
+bool vrs_interpolate(const struct naive_data* naive, int rate, int x, int y,
+	v3* color) {
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const int width = gbuffer->width;
+	const int height = gbuffer->height;
+	const size_t pixel = (size_t) y * width + x;
+	const int x0 = x - ((x - naive->vrs_origin) % rate + rate) % rate;
+	const int y0 = y - y % rate;
+	const float fx = (float) (x - x0) / rate;
+	const float fy = (float) (y - y0) / rate;
+	const v3 n = gbuffer->normal[pixel];
+	const float dist = gbuffer->dist[pixel];
+	v3 sum = {0.f, 0.f, 0.f};
+	float total = 0.f;
+	float lo = INFINITY;
+	float hi = 0.f;
+
+	for (int i = 0; i < 4; i++) {
+		int sx = x0 + (i & 1) * rate;
+		int sy = y0 + (i >> 1) * rate;
+		float w = (i & 1 ? fx : 1.f - fx) * (i >> 1 ? fy : 1.f - fy);
+		if (sx < 0 || sx >= width || sy >= height || w <= 0.f)
+			continue;
+
+		/* Those of a tile at 2x2 can fall on one at 4x4 */
+		if (!vrs_sample(naive, vrs_rate_at(naive, sx, sy), sx, sy))
+			continue;
+
+		size_t sample = (size_t) sy * width + sx;
+		float facing = v3dot(n, gbuffer->normal[sample]);
+		if (gbuffer->id[sample] != gbuffer->id[pixel] || facing <= 0.f
+		    || fabsf(gbuffer->dist[sample] - dist)
+		       > VRS_DEPTH_TOLERANCE * dist)
+			continue;
+
+		float b = aa_brightness(gbuffer->color[sample]);
+		lo = minf(lo, b);
+		hi = maxf(hi, b);
+		facing *= facing;
+		facing *= facing;
+		sum = v3add(sum, v3scale(gbuffer->color[sample], w * facing));
+		total += w * facing;
+	}
+
+	if (total < 1e-3f || hi - lo > VRS_CONTRAST)
+		return false;
+	*color = v3scale(sum, 1.f / total);
+	return true;
+}
+
+/* Fills in the hits the lighting pass skipped. It only reads the samples, so
+ * rows can go in any order and, unless a later pass follows, straight to the
+ * surface. */
+static
+void vrs_pass(struct naive_data* naive, struct render_stats* stats, v3* row,
+	SDL_Surface* surf, bool output) {
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const int width = surf->w;
+	const int height = surf->h;
+	int y;
+
+	while ((y = SDL_AtomicAdd(&naive->vrs_fill_line, 1)) < height) {
+		Uint64 start = SDL_GetPerformanceCounter();
+		v3* color = gbuffer->color + (size_t) y * width;
+		Uint64 filled = 0;
+
+		for (int x = 0; x < width; x++) {
+			int rate = vrs_rate_at(naive, x, y);
+			if (!gbuffer->id[(size_t) y * width + x]
+			    || cb_untraced(naive, x, y)
+			    || vrs_sample(naive, rate, x, y))
+				continue;
+
+			filled++;
+			if (vrs_interpolate(naive, rate, x, y, &color[x])) {
+				stats->count[STAT_VRS_INTERPOLATED]++;
+				continue;
+			}
+			color[x] = shade_pixel(naive, stats, x, y, width,
+			                       height);
+			stats->count[STAT_VRS_SHADED]++;
+		}
+		stage_done(stats, STAGE_INTERPOLATE, &start, filled);
+
+		if (!output)
+			continue;
+		memcpy(row, color, sizeof(v3) * width);
+		output_frame_row(naive, y, row, surf);
+	}
+}
+
+/* Default mode, in two passes: the geometry pass marches the primary rays
+ * and fills the G-buffer, once every thread is done with it the lighting pass
+ * shades the hits and writes the pixels. Lights with a shadow map get an
+ * extra pass in between to trace it, as do the rates with --vrs. The passes
+ * that fill in what the lighting pass skipped (--vrs, then --checkerboard)
+ * and the AA pass come after, the last of them writes the pixels. */
+static
+void render_deferred(struct naive_data* naive, struct render_stats* stats,
+	struct span* spans, v3* row, SDL_Surface* surf) {
+	const struct scene* scene = naive->scene;
+	const struct tiles* tiles = &naive->tiles;
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const int width = surf->w;
+	const int height = surf->h;
+	const float fwidth = width;
+	const float fheight = height;
+	const float aspect_ratio = fwidth / fheight;
+	const v3 ro = scene->camera.point;
+	const v3 sky = get_sky(scene);
+	const v2 jitter = naive->jitter;
+	const bool cb_frame = naive->checkerboard && naive->cb_frame;
+	const bool vrs_frame = naive->vrs_frame;
+	const bool keep_colors = naive->aa_samples || naive->checkerboard
+	                         || naive->vrs;
+	int y;
+
+	while ((y = SDL_AtomicAdd(&current_line, 1)) < height)
+	for (int x = 0; x < width; x++) {
+		size_t pixel = (size_t) y * width + x;
+		size_t tile = y / TILE_SIZE * tiles->width + x / TILE_SIZE;
+
+		/* Kept from the last frame */
+		if (!dirty_pixel(naive, x, y))
+			continue;
+		/* Left for the reconstruction, a miss to the shadow pass */
+		if (cb_untraced(naive, x, y)) {
+			gbuffer->id[pixel] = 0;
+			continue;
+		}
+
+		v2 view_pos = pixel_to_view(x + jitter.x, y + jitter.y,
+		                            fwidth, fheight);
+
+		v3 rd = get_camera_ray(scene->camera, view_pos, aspect_ratio);
+		struct world_dist intersect = get_intersection(naive, stats,
+			tiles->items + tile * tiles->capacity,
+			tiles->count[tile], spans, ro, rd);
+		gbuffer->dist[pixel] = intersect.dist;
+		gbuffer->id[pixel] = intersect.id;
+		if (intersect.id) {
+			float h = footprint(naive, intersect.dist);
+			v3 p = v3add(ro, v3scale(rd, intersect.dist));
+			gbuffer->normal[pixel] = get_normal(scene, p, h);
+		}
+	}
+
+	barrier_wait(&naive->barrier);
+
+	if (vrs_frame)
+		vrs_rate_pass(naive);
+	if (naive->shadow_rows)
+		shadow_pass(naive, stats, width, height);
+	if (naive->shadow_rows || vrs_frame)
+		barrier_wait(&naive->barrier);
+
+	while ((y = SDL_AtomicAdd(&naive->shade_line, 1)) < height) {
+		/* The later passes look at the neighbours of the pixels */
+		v3* out = keep_colors
+		          ? gbuffer->color + (size_t) y * width : row;
+
+		for (int x = 0; x < width; x++) {
+			if (!dirty_pixel(naive, x, y)) {
+				out[x] = naive->last[(size_t) y * width + x];
+				continue;
+			}
+			if (cb_untraced(naive, x, y))
+				continue;
+
+			out[x] = sky;
+			if (!gbuffer->id[(size_t) y * width + x])
+				continue;
+			if (vrs_frame && !vrs_sample(naive,
+			                             vrs_rate_at(naive, x, y),
+			                             x, y))
+				continue;
+
+			out[x] = shade_pixel(naive, stats, x, y, width,
+			                     height);
+		}
+		if (naive->aa_samples || cb_frame || vrs_frame)
+			continue;
+		if (out != row)
+			memcpy(row, out, sizeof(v3) * width);
+		output_frame_row(naive, y, row, surf);
+	}
+
+	if (vrs_frame) {
+		barrier_wait(&naive->barrier);
+		vrs_pass(naive, stats, row, surf,
+		         !naive->aa_samples && !cb_frame);
+	}
+	if (cb_frame) {
+		barrier_wait(&naive->barrier);
+		reconstruct_pass(naive, stats, row, surf, !naive->aa_samples);
+	}
+	if (naive->aa_samples) {
+		barrier_wait(&naive->barrier);
+		aa_pass(naive, stats, spans, row, surf);
+	}
+}
+
+/* Once converged the frames only put the average on the surface again */
+static
+void output_accumulated(const struct naive_data* naive, v3* row,
+	SDL_Surface* surf) {
+	const v3* accum = naive->accum;
+	const float scale = 1.f / naive->samples;
+	const int width = surf->w;
+	int y;
+
+	while ((y = SDL_AtomicAdd(&current_line, 1)) < surf->h) {
+		for (int x = 0; x < width; x++)
+			row[x] = v3scale(accum[(size_t) y * width + x], scale);
+		output_row(&naive->output, surf, y, row, width);
+	}
+}
+
+int render_thread(void* ptr) {
+	struct render_data* data = ptr;
+	struct span* spans = NULL;
+	struct wavefront wf = {0};
+	v3* row = NULL;		/* Colors on their way to the surface */
+
+	while (true) {
+		barrier_wait(&frame_barrier);
+		if (SDL_AtomicGet(&exiting)) {
+			wavefront_free(&wf);
+			free(spans);
+			free(row);
+			return 0;
+		}
+
+		const struct scene* scene = data->scene;
+		struct naive_data* naive = data->private;
+		spans = realloc(spans, sizeof(struct span)
+		                       * (scene->objects->size + 1));
+		row = realloc(row, sizeof(v3) * data->surf->w);
+		struct render_stats stats = {0};
+
+		if (naive->converged)
+			output_accumulated(naive, row, data->surf);
+		else if (naive->wavefront)
+			render_wavefront(naive, &wf, &stats, spans, row,
+			                 data->surf);
+		else
+			render_deferred(naive, &stats, spans, row, data->surf);
+
+		render_stats_merge(&data->stats, &stats);
+		barrier_wait(&frame_barrier);
+	}
+}
+
+void render_prepare(struct render_data* data, int argc, const char* argv[]) {
+	struct naive_data* naive = calloc(1, sizeof(struct naive_data));
+	const struct scene* scene = data->scene;
+	bool use_bricks = false;
+	size_t bricks_budget = 32;
+	int brick_res = 8;
+	char* bricks_path = NULL;
+	float cache_cell = 0.f;
+	size_t cache_budget = 32;
+	int max_samples = 64;
+	float aa_budget = .5f;
+	bool dirty_regions = true;
+	Uint32 idx = 0;
+
+	output_init();
+
+	for (int i = 3; i < argc; i++)
+		if (strcmp("--bricks", argv[i]) == 0)
+			use_bricks = true;
+		else if (strcmp("--bricks-mb", argv[i]) == 0 && i + 1 < argc)
+			bricks_budget = atoi(argv[++i]);
+		else if (strcmp("--brick-res", argv[i]) == 0 && i + 1 < argc)
+			brick_res = atoi(argv[++i]);
+		else if (strcmp("--omega", argv[i]) == 0 && i + 1 < argc)
+			naive->omega = atof(argv[++i]);
+		else if (strcmp("--lod", argv[i]) == 0 && i + 1 < argc)
+			naive->lod = atof(argv[++i]);
+		else if (strcmp("--wavefront", argv[i]) == 0)
+			naive->wavefront = true;
+		else if (strcmp("--shadow-scale", argv[i]) == 0
+		         && i + 1 < argc)
+			naive->shadow_scale = atoi(argv[++i]);
+		else if (strcmp("--light-threshold", argv[i]) == 0
+		         && i + 1 < argc)
+			naive->light_threshold = atof(argv[++i]);
+		else if (strcmp("--light-samples", argv[i]) == 0
+		         && i + 1 < argc)
+			naive->light_samples = atoi(argv[++i]);
+		else if (strcmp("--shadow-cache", argv[i]) == 0
+		         && i + 1 < argc)
+			cache_cell = atof(argv[++i]);
+		else if (strcmp("--shadow-cache-mb", argv[i]) == 0
+		         && i + 1 < argc)
+			cache_budget = atoi(argv[++i]);
+		else if (strcmp("--accumulate", argv[i]) == 0 && i + 1 < argc)
+			max_samples = atoi(argv[++i]);
+		else if (strcmp("--aa", argv[i]) == 0 && i + 1 < argc)
+			naive->aa_samples = atoi(argv[++i]);
+		else if (strcmp("--aa-budget", argv[i]) == 0 && i + 1 < argc)
+			aa_budget = atof(argv[++i]);
+		else if (strcmp("--checkerboard", argv[i]) == 0)
+			naive->checkerboard = true;
+		else if (strcmp("--vrs", argv[i]) == 0)
+			naive->vrs = true;
+		else if (strcmp("--vrs-overlay", argv[i]) == 0)
+			naive->vrs = naive->vrs_overlay = true;
+		else if (strcmp("--no-dirty", argv[i]) == 0)
+			dirty_regions = false;
+
+	/* Past 2 the relaxed steps would overshoot even flat surfaces */
+	naive->omega = clamp(naive->omega, 1.f, 1.9f);
+	naive->shadow_scale = naive->shadow_scale > 1 ? naive->shadow_scale : 1;
+	/* The overlay shows on frames shaded at rates, never accumulated */
+	naive->max_samples = max_samples > 1 && !naive->vrs_overlay
+	                     ? max_samples : 0;
+	if (naive->aa_samples > AA_MAX_SAMPLES)
+		naive->aa_samples = AA_MAX_SAMPLES;
+	/* The wavefront mode has no G-buffer to find the edges in, or to
+	 * reproject */
+	if (naive->aa_samples < 2 || naive->wavefront)
+		naive->aa_samples = 0;
+	naive->checkerboard = naive->checkerboard && !naive->wavefront;
+	naive->vrs = naive->vrs && !naive->wavefront;
+	naive->vrs_overlay = naive->vrs_overlay && naive->vrs;
+	/* Nor does it keep the colors */
+	naive->dirty_regions = dirty_regions && !naive->wavefront;
+	naive->aa_budget = aa_budget > 0.f ? aa_budget : 0.f;
+	naive->scene = scene;
+	barrier_init(&naive->barrier, data->num_threads);
+	data->private = naive;
+
+	if (cache_cell > 0.f) {
+		naive->shadow_cache = shadow_cache_new(cache_cell,
+		                                       cache_budget << 20);
+		naive->cache_generation = scene->generation;
+	}
+
+	if (!use_bricks || brick_res < 2)
+		return;
+
+	/* Cache the bricks next to the scene */
+	if (argc > 2) {
+		bricks_path = malloc(strlen(argv[2]) + sizeof(".bricks"));
+		strcpy(bricks_path, argv[2]);
+		strcat(bricks_path, ".bricks");
+	}
+
+	naive->bricks = bricks_open(scene, bricks_path, bricks_budget << 20,
+	                            brick_res, data->num_threads);
+	naive->bricks_generation = scene->generation;
+	free(bricks_path);
+
+	naive->unbounded = malloc(sizeof(Uint32) * scene->objects->size);
+	vector_foreach(struct object, scene->objects, obj) {
+		if (isinf(object_bounds(obj).radius))
+			naive->unbounded[naive->num_unbounded++] = idx;
+		idx++;
+	}
+}
+
+/* The G-buffer of the last frame becomes the history of this one, while the
+ * size doesn't change. Checkerboard frames only while the view moves, once
+ * the samples of a still view add up they trace every pixel. */
+static
+void history_update(struct naive_data* naive, int width, int height) {
+	struct history* history = &naive->history;
+	struct gbuffer* gbuffer = &naive->gbuffer;
+	size_t size = (size_t) width * height;
+
+	if (history->width != width || history->height != height) {
+		history->width = width;
+		history->height = height;
+		history->dist = realloc(history->dist, sizeof(float) * size);
+		history->id = realloc(history->id, sizeof(Uint32) * size);
+		history->color = realloc(history->color, sizeof(v3) * size);
+		history->valid = false;
+	} else {
+		float* dist = history->dist;
+		Uint32* id = history->id;
+		v3* color = history->color;
+
+		history->dist = gbuffer->dist;
+		history->id = gbuffer->id;
+		history->color = gbuffer->color;
+		gbuffer->dist = dist;
+		gbuffer->id = id;
+		gbuffer->color = color;
+		history->valid = true;
+	}
+	history->camera = naive->cb_camera;
+	naive->cb_camera = naive->scene->camera;
+
+	naive->cb_frame = !naive->max_samples || naive->samples == 1;
+	naive->cb_parity ^= 1;
+	SDL_AtomicSet(&naive->cb_line, 0);
+}
+
+/* Whether softshadow from p can see the bounds: it darkens within
+ * t / SHADOW_SHARPNESS of an object t along the ray, which goes a unit past
+ * the light */
+static inline
+bool shadow_touches(v3 p, v3 light, struct bounds bounds) {
+	v3 rel = v3sub(light, p);
+	float len = v3len(rel);
+	v3 dir = v3scale(rel, 1.f / len);
+	float t = clamp(v3dot(v3sub(bounds.center, p), dir), 0.f, len + 1.f);
+	v3 closest = v3add(p, v3scale(dir, t));
+
+	return v3len(v3sub(bounds.center, closest))
+	       < bounds.radius + (len + 1.f) / SHADOW_SHARPNESS;
+}
+
+/* Marks the tiles of the hits of the last frame an edit can change the
+ * lighting of: those in reach of a moved light before or after, or whose
+ * shadow rays pass by a moved object. */
+static
+void dirty_hits(struct naive_data* naive, bool light,
+	const struct bounds* moved) {
+	const struct scene* scene = naive->scene;
+	const struct light* lights = scene->lights->data;
+	const struct gbuffer* gbuffer = &naive->gbuffer;
+	const int width = naive->last_width;
+	const int height = naive->last_height;
+	const float aspect_ratio = (float) width / height;
+	const v3 ro = naive->last_camera.point;
+	const v2 jitter = naive->last_jitter;
+
+	for (int ty = 0; ty < naive->tiles.height; ty++)
+	for (int tx = 0; tx < naive->tiles.width; tx++) {
+		Uint8* dirty = &naive->dirty[ty * naive->tiles.width + tx];
+		int x1 = (tx + 1) * TILE_SIZE < width ? (tx + 1) * TILE_SIZE
+		                                      : width;
+		int y1 = (ty + 1) * TILE_SIZE < height ? (ty + 1) * TILE_SIZE
+		                                       : height;
+
+		for (int y = ty * TILE_SIZE; y < y1 && !*dirty; y++)
+		for (int x = tx * TILE_SIZE; x < x1 && !*dirty; x++) {
+			size_t pixel = (size_t) y * width + x;
+			if (!gbuffer->id[pixel])
+				continue;
+
+			v2 view_pos = pixel_to_view(x + jitter.x,
+			                            y + jitter.y, width,
+			                            height);
+			v3 rd = get_camera_ray(naive->last_camera, view_pos,
+			                       aspect_ratio);
+			v3 p = v3add(ro, v3scale(rd, gbuffer->dist[pixel]));
+
+			for (int i = 0; i < 2 && light; i++)
+				*dirty |= v3len(v3sub(p, moved[i].center))
+				          < moved[i].radius;
+
+			for (size_t l = 0; l < scene->lights->size && !light;
+			     l++) {
+				if (light_falloff(&lights[l], p) <= 0.f)
+					continue;
+				*dirty |= shadow_touches(p, lights[l].point,
+				                         moved[0])
+				          || shadow_touches(p, lights[l].point,
+				                            moved[1]);
+			}
+		}
+	}
+}
+
+/* Marks the tiles an edit can change. False when it reaches everywhere:
+ * unbounded objects, lights without a radius. */
+static
+bool dirty_change(struct naive_data* naive,
+	const struct scene_change* change) {
+	const struct scene* scene = naive->scene;
+	struct bounds moved[2];
+	int x0, y0, x1, y1;
+
+	if (change->light) {
+		const struct light* light = &vector_get(struct light,
+			scene->lights, change->index);
+		moved[0] = naive->light_bounds[change->index];
+		moved[1] = (struct bounds) {light->point, light->radius};
+		if (isinf(moved[0].radius) || light->radius <= 0.f)
+			return false;
+	} else {
+		moved[0] = naive->bounds[change->index];
+		moved[1] = object_bounds(&vector_get(struct object,
+			scene->objects, change->index));
+		if (isinf(moved[0].radius) || isinf(moved[1].radius))
+			return false;
+	}
+
+	/* Where the object was and is seen */
+	for (int i = 0; i < 2 && !change->light; i++) {
+		if (!project_bounds(&naive->last_camera, moved[i],
+		                    naive->last_width, naive->last_height,
+		                    &x0, &y0, &x1, &y1))
+			continue;
+		for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+		for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+			naive->dirty[ty * naive->tiles.width + tx] = 1;
+	}
+
+	dirty_hits(naive, change->light, moved);
+	return true;
+}
+
+/* Whether this frame can redraw only the tiles the edits since the last one
+ * touched, and which those are. The last frame has to have the same view and
+ * size, and the edits have to be in the log. Runs before anything of the
+ * last frame (bounds, G-buffer) is updated. */
+static
+bool dirty_update(struct naive_data* naive, int width, int height) {
+	const struct scene* scene = naive->scene;
+	unsigned edits = scene->generation - naive->last_generation;
+
+	if (naive->last_width != width || naive->last_height != height
+	    || !camera_equal(&scene->camera, &naive->last_camera)
+	    || !edits || edits > SCENE_CHANGES)
+		return false;
+
+	memset(naive->dirty, 0, naive->tiles.width * naive->tiles.height);
+	for (unsigned i = 1; i <= edits; i++) {
+		const struct scene_change* change = scene_change_get(scene,
+			naive->last_generation + i);
+		if (!change || !dirty_change(naive, change))
+			return false;
+	}
+
+	return true;
+}
+
+/* The bricks hold the objects where they were baked, the first edit that
+ * moves one drops them and the exact distance takes over. Rebaking would
+ * take seconds per edit, and overwrite the cache of the scene file with a
+ * scene that isn't in it. Lights aren't in the bricks. */
+static
+void bricks_update(struct naive_data* naive) {
+	const struct scene* scene = naive->scene;
+	unsigned edits = scene->generation - naive->bricks_generation;
+	bool stale = edits > SCENE_CHANGES;
+
+	for (unsigned i = 1; i <= edits && !stale; i++) {
+		const struct scene_change* change = scene_change_get(scene,
+			naive->bricks_generation + i);
+		stale = !change || !change->light;
+	}
+	naive->bricks_generation = scene->generation;
+	if (!stale)
+		return;
+
+	fprintf(stderr, "An object moved, the bricks are off\n");
+	bricks_free(naive->bricks);
+	naive->bricks = NULL;
+}
+
+/* Keeps what the next frame needs to tell its dirty tiles */
+static
+void last_update(struct naive_data* naive, int width, int height) {
+	size_t tiles = (size_t) ((width + TILE_SIZE - 1) / TILE_SIZE)
+	               * ((height + TILE_SIZE - 1) / TILE_SIZE);
+
+	if (naive->last_width != width || naive->last_height != height) {
+		naive->last = realloc(naive->last,
+		                      sizeof(v3) * width * height);
+		naive->dirty = realloc(naive->dirty, tiles);
+		naive->last_width = width;
+		naive->last_height = height;
+	}
+	naive->last_camera = naive->scene->camera;
+	naive->last_jitter = naive->jitter;
+	naive->last_generation = naive->scene->generation;
+}
+
+/* Follows the size with the rates of the tiles. Like checkerboarding it's
+ * only while the view moves. */
+static
+void vrs_update(struct naive_data* naive, int width, int height,
+	bool same_size) {
+	int tiles_width = (width + VRS_TILE - 1) / VRS_TILE;
+	int tiles_height = (height + VRS_TILE - 1) / VRS_TILE;
+
+	if (naive->vrs_width != tiles_width
+	    || naive->vrs_height != tiles_height) {
+		naive->vrs_width = tiles_width;
+		naive->vrs_height = tiles_height;
+		naive->vrs_rate = realloc(naive->vrs_rate,
+		                          tiles_width * tiles_height);
+	}
+
+	/* history_update already swapped the last colors out of the way */
+	naive->vrs_colors = !same_size ? NULL
+	                    : naive->checkerboard ? naive->history.color
+	                                          : naive->gbuffer.color;
+	naive->vrs_frame = !naive->max_samples || naive->samples == 1;
+	naive->vrs_origin = naive->checkerboard && naive->cb_frame
+	                    ? naive->cb_parity : 0;
+	SDL_AtomicSet(&naive->vrs_line, 0);
+	SDL_AtomicSet(&naive->vrs_fill_line, 0);
+}
+
+/* Starts over when anything that shows changed, otherwise picks the offset
+ * of the next sample: the pixel center first, then a Halton (2, 3) sequence
+ * over the pixel */
+static
+void accumulate_update(struct naive_data* naive, int width, int height) {
+	const struct scene* scene = naive->scene;
+
+	if (width != naive->accum_width || height != naive->accum_height) {
+		naive->accum = realloc(naive->accum,
+		                       sizeof(v3) * width * height);
+		naive->accum_width = width;
+		naive->accum_height = height;
+		naive->samples = 0;
+	}
+	if (!camera_equal(&scene->camera, &naive->accum_camera)
+	    || scene->generation != naive->accum_generation) {
+		naive->accum_camera = scene->camera;
+		naive->accum_generation = scene->generation;
+		naive->samples = 0;
+	}
+
+	naive->converged = naive->samples == naive->max_samples;
+	if (naive->converged)
+		return;
+
+	naive->jitter = naive->samples
+		? (v2) {halton(naive->samples, 2) - .5f,
+		        halton(naive->samples, 3) - .5f}
+		: (v2) {0.f, 0.f};
+	naive->samples++;
+}
+
+void render_begin_frame(struct render_data* data) {
+	struct naive_data* naive = data->private;
+	const struct scene* scene = data->scene;
+	int width = data->surf->w;
+	int height = data->surf->h;
+	size_t idx = 0;
+	bool same_size;
+
+	output_format_update(&naive->output, data->surf->format);
+
+	if (naive->max_samples) {
+		accumulate_update(naive, width, height);
+		if (naive->converged)
+			return;
+	}
+
+	/* Before anything traces the edited scene */
+	if (naive->bricks)
+		bricks_update(naive);
+
+	/* Edits with the view holding still redraw what they touched, with
+	 * every pixel traced and lit as usual */
+	naive->partial = naive->dirty_regions
+	                 && dirty_update(naive, width, height);
+	if (naive->partial) {
+		size_t tiles = naive->tiles.width * naive->tiles.height;
+		for (size_t i = 0; i < tiles; i++)
+			data->stats.count[STAT_DIRTY_TILES] += naive->dirty[i];
+		data->stats.count[STAT_CLEAN_TILES] =
+			tiles - data->stats.count[STAT_DIRTY_TILES];
+	}
+	if (naive->dirty_regions)
+		last_update(naive, width, height);
+
+	naive->bounds = realloc(naive->bounds,
+	                        sizeof(struct bounds) * scene->objects->size);
+	vector_foreach(struct object, scene->objects, obj)
+		naive->bounds[idx++] = object_bounds(obj);
+
+	/* The same view extents get_camera_ray uses */
+	naive->pixel_angle = 2.f * atanf(scene->camera.fov / 2.f) / height;
+
+	SDL_AtomicSet(&naive->shade_line, 0);
+	same_size = naive->gbuffer.width == width
+	            && naive->gbuffer.height == height;
+	gbuffer_resize(&naive->gbuffer, width, height,
+	               naive->aa_samples || naive->checkerboard || naive->vrs);
+	/* The G-buffer of a partial frame has to stay the last one */
+	if (naive->checkerboard && !naive->partial)
+		history_update(naive, width, height);
+	if (naive->vrs)
+		vrs_update(naive, width, height, same_size);
+	if (naive->partial)
+		naive->cb_frame = naive->vrs_frame = false;
+	SDL_AtomicSet(&naive->aa_line, 0);
+	SDL_AtomicSet(&naive->aa_counted, 0);
+	SDL_AtomicSet(&naive->aa_trace_line, 0);
+	naive->aa_rays_max = naive->aa_budget * width * height;
+	if (naive->aa_samples)
+		naive->aa_edges = realloc(naive->aa_edges,
+		                          sizeof(int) * height);
+	shadow_maps_update(naive, width, height);
+
+	/* Cached shadows are only good for the scene they were traced in */
+	if (naive->shadow_cache
+	    && naive->cache_generation != scene->generation) {
+		shadow_cache_clear(naive->shadow_cache);
+		naive->cache_generation = scene->generation;
+	}
+	if (naive->shadow_cache)
+		shadow_cache_tick(naive->shadow_cache);
+	tiles_resize(&naive->tiles, width, height, scene->objects->size);
+	bin_bounds(&naive->tiles, scene->camera, naive->bounds,
+	           scene->objects->size, width, height,
+	           naive->lod * naive->pixel_angle);
+
+	/* Lights are binned by their sphere of influence */
+	idx = 0;
+	naive->light_bounds = realloc(naive->light_bounds,
+	                              sizeof(struct bounds)
+	                              * scene->lights->size);
+	vector_foreach(struct light, scene->lights, light)
+		naive->light_bounds[idx++] = (struct bounds) {
+			light->point,
+			light->radius > 0.f ? light->radius : INFINITY
+		};
+
+	tiles_resize(&naive->light_tiles, width, height, scene->lights->size);
+	bin_bounds(&naive->light_tiles, scene->camera, naive->light_bounds,
+	           scene->lights->size, width, height, 0.f);
+	naive->frame++;
+}
+
+bool render_refining(const struct render_data* data) {
+	const struct naive_data* naive = data->private;
+
+	/* The first frame had no colors to pick the rates from */
+	if (naive->vrs_overlay && !naive->vrs_colors)
+		return true;
+	return naive->max_samples && naive->samples < naive->max_samples;
+}
+
+/* Bounds and tiles are rebuilt every frame, the bricks drop out on edits */
+bool render_editable(const struct render_data* data) {
+	return true;
+}
+
+void render_destroy(struct render_data* scene) {
+	struct naive_data* naive = scene->private;
+
+	bricks_free(naive->bricks);
+	shadow_cache_free(naive->shadow_cache);
+	free(naive->unbounded);
+	free(naive->bounds);
+	free(naive->accum);
+	free(naive->tiles.count);
+	free(naive->tiles.items);
+	free(naive->light_bounds);
+	free(naive->light_tiles.count);
+	free(naive->light_tiles.items);
+	free(naive->gbuffer.dist);
+	free(naive->gbuffer.id);
+	free(naive->gbuffer.normal);
+	free(naive->gbuffer.color);
+	free(naive->aa_edges);
+	free(naive->history.dist);
+	free(naive->history.id);
+	free(naive->history.color);
+	free(naive->vrs_rate);
+	free(naive->dirty);
+	free(naive->last);
+	for (size_t i = 0; i < naive->num_shadow_maps; i++) {
+		free(naive->shadow_maps[i].shadow);
+		free(naive->shadow_maps[i].point);
+		free(naive->shadow_maps[i].normal);
+	}
+	free(naive->shadow_maps);
+	free(naive);
 }
@@ -0,0 +1,155 @@
+#include <immintrin.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "output.h"
+
+/* Floats in [0, 1] bucketed by their bits above these, each bucket spans
+ * less than a byte of output */
+#define BUCKET_SHIFT	16
+#define NUM_BUCKETS	((0x3F800000 >> BUCKET_SHIFT) + 1)
+
+/* Byte at the start of each bucket, padded for the 32-bit gathers */
+static Uint8 bucket_byte[NUM_BUCKETS + 3];
+/* Smallest float that gives each byte, INFINITY past 255 */
+static float byte_start[257];
+
+static inline
+float float_from_bits(Uint32 bits) {
+	float rval;
+	memcpy(&rval, &bits, sizeof(rval));
+	return rval;
+}
+
+/* The conversion the tables stand for */
+static inline
+Uint8 exact_byte(float c) {
+	return powf(c, 1.f / 2.2f) * 255;
+}
+
+void output_init(void) {
+	for (int k = 1; k < 256; k++) {
+		Uint32 lo = 0;
+		Uint32 hi = 0x3F800000;
+		while (lo < hi) {
+			Uint32 mid = lo + (hi - lo) / 2;
+			if (exact_byte(float_from_bits(mid)) >= k)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		byte_start[k] = float_from_bits(lo);
+	}
+	byte_start[0] = 0.f;
+	byte_start[256] = INFINITY;
+
+	for (Uint32 i = 0; i < NUM_BUCKETS; i++)
+		bucket_byte[i] = exact_byte(float_from_bits(i << BUCKET_SHIFT));
+}
+
+void output_format_update(struct output_format* out,
+	const SDL_PixelFormat* fmt) {
+	if (out->format == fmt->format)
+		return;
+
+	out->format = fmt->format;
+	out->packed = fmt->BytesPerPixel == 4
+	              && !fmt->Rloss && !fmt->Gloss && !fmt->Bloss;
+	out->shift[0] = fmt->Rshift;
+	out->shift[1] = fmt->Gshift;
+	out->shift[2] = fmt->Bshift;
+	out->alpha = fmt->Amask;
+}
+
+static inline
+Uint8 gamma_byte(float c) {
+	Uint32 bits;
+	Uint8 k;
+
+	/* Written out so NaN and -0 end up as +0 too */
+	c = c > 0.f ? c : 0.f;
+	c = c < 1.f ? c : 1.f;
+	memcpy(&bits, &c, sizeof(bits));
+	k = bucket_byte[bits >> BUCKET_SHIFT];
+	return k + (c >= byte_start[k + 1]);
+}
+
+static inline
+__m256i gamma_bytes8(__m256 c) {
+	c = _mm256_min_ps(_mm256_max_ps(c, _mm256_setzero_ps()),
+	                  _mm256_set1_ps(1.f));
+	__m256i idx = _mm256_srli_epi32(_mm256_castps_si256(c), BUCKET_SHIFT);
+	__m256i k = _mm256_and_si256(
+		_mm256_i32gather_epi32((const int*) bucket_byte, idx, 1),
+		_mm256_set1_epi32(0xFF));
+	__m256 next = _mm256_i32gather_ps(byte_start + 1, k, 4);
+
+	/* The compare gives -1 where it's one more */
+	return _mm256_sub_epi32(k, _mm256_castps_si256(
+		_mm256_cmp_ps(c, next, _CMP_GE_OQ)));
+}
+
+static inline
+Uint32 pack_pixel(const struct output_format* out, v3 c) {
+	return (Uint32) gamma_byte(c.x) << out->shift[0]
+	       | (Uint32) gamma_byte(c.y) << out->shift[1]
+	       | (Uint32) gamma_byte(c.z) << out->shift[2]
+	       | out->alpha;
+}
+
+/* Eight pixels, each v3 is x, y, z and padding in a __m128 */
+static inline
+__m256i pack_pixels8(const struct output_format* out, const v3* c) {
+	__m256 p04 = _mm256_set_m128(c[4].vec, c[0].vec);
+	__m256 p15 = _mm256_set_m128(c[5].vec, c[1].vec);
+	__m256 p26 = _mm256_set_m128(c[6].vec, c[2].vec);
+	__m256 p37 = _mm256_set_m128(c[7].vec, c[3].vec);
+	/* 4x4 transposes in each half */
+	__m256 xy01 = _mm256_unpacklo_ps(p04, p15);
+	__m256 zw01 = _mm256_unpackhi_ps(p04, p15);
+	__m256 xy23 = _mm256_unpacklo_ps(p26, p37);
+	__m256 zw23 = _mm256_unpackhi_ps(p26, p37);
+	__m256 x = _mm256_shuffle_ps(xy01, xy23, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 y = _mm256_shuffle_ps(xy01, xy23, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 z = _mm256_shuffle_ps(zw01, zw23, _MM_SHUFFLE(1, 0, 1, 0));
+
+	__m256i r = _mm256_sll_epi32(gamma_bytes8(x),
+	                             _mm_cvtsi32_si128(out->shift[0]));
+	__m256i g = _mm256_sll_epi32(gamma_bytes8(y),
+	                             _mm_cvtsi32_si128(out->shift[1]));
+	__m256i b = _mm256_sll_epi32(gamma_bytes8(z),
+	                             _mm_cvtsi32_si128(out->shift[2]));
+
+	return _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(
+		b, _mm256_set1_epi32(out->alpha)));
+}
+
+void output_row(const struct output_format* out, SDL_Surface* surf, int y,
+	const v3* colors, int width) {
+	Uint8* row = (Uint8*) surf->pixels + (size_t) y * surf->pitch;
+	Uint32* dst = (Uint32*) row;
+	int x = 0;
+
+	if (!out->packed) {
+		Uint8 bytes_per_pixel = surf->format->BytesPerPixel;
+		for (; x < width; x++)
+			*(Uint32*) (row + x * bytes_per_pixel) = SDL_MapRGB(
+				surf->format, gamma_byte(colors[x].x),
+				gamma_byte(colors[x].y),
+				gamma_byte(colors[x].z));
+		return;
+	}
+
+	/* Streaming stores need 32-byte alignment, the rest goes one by one */
+	for (; x < width && ((uintptr_t) (dst + x) & 31); x++)
+		dst[x] = pack_pixel(out, colors[x]);
+	for (; x + 8 <= width; x += 8)
+		_mm256_stream_si256((__m256i*) (dst + x),
+		                    pack_pixels8(out, colors + x));
+	for (; x < width; x++)
+		dst[x] = pack_pixel(out, colors[x]);
+
+	/* Visible to the thread presenting the frame */
+	_mm_sfence();
+}
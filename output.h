@@ -0,0 +1,34 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+#include <stdbool.h>
+#include <SDL.h>
+#include "vec.h"
+
+/* Conversion of rows of linear colors to the surface, clamped to [0, 1] and
+ * gamma corrected. It gives exactly what colorf_to_pixfmt(v3pow(c, 1 / 2.2)) does,
+ * from tables: a byte per float bucket (the top bits of the float, monotonic
+ * for positive floats) that is at most one short, and the smallest float of
+ * each byte to fix that up.
+ *
+ * 32-bit surfaces with 8-bit channels take the AVX2 path: eight pixels
+ * shuffled to SoA, two gathers per channel, packed with the shifts of the
+ * format and written with streaming stores. Any other format goes through
+ * SDL_MapRGB pixel by pixel. */
+struct output_format {
+	Uint32	format;		/* SDL_PixelFormatEnum this was resolved for */
+	bool	packed;		/* 32 bits, 8 per channel */
+	Uint32	shift[3];	/* Of the red, green and blue bytes */
+	Uint32	alpha;		/* Amask, opaque as SDL_MapRGB leaves it */
+};
+
+/* Builds the tables, once before any output_row */
+void output_init(void);
+
+/* Resolves the layout of fmt if it isn't the one out already has */
+void output_format_update(struct output_format* out,
+	const SDL_PixelFormat* fmt);
+
+void output_row(const struct output_format* out, SDL_Surface* surf, int y,
+	const v3* colors, int width);
+
+#endif /* __OUTPUT_H__ */
@@ -1,19 +1,75 @@
 #ifndef __RENDERER_H__
 #define __RENDERER_H__
 #include <SDL.h>
+#include "barrier.h"
 #include "scene.h"
 
 extern SDL_atomic_t	exiting;
 extern SDL_atomic_t	current_line;
-extern SDL_sem*		frame_entry_barrier;
-extern SDL_sem*		frame_exit_barrier;
+/* The workers and the main thread meet here twice a frame: to start it and
+ * once it's done */
+extern struct barrier	frame_barrier;
+
+/* Per-frame counters filled in by the renderers and logged by render_scene */
+enum render_stat {
+	STAT_PRIMARY_RAYS,
+	STAT_PRIMARY_STEPS,
+	STAT_SHADOW_RAYS,
+	STAT_SHADOW_STEPS,
+	STAT_SHADOW_CACHE_HITS,
+	STAT_AA_PIXELS,		/* Supersampled */
+	STAT_AA_RAYS,		/* Extra primary rays they took */
+	STAT_CB_REPROJECTED,	/* Untraced pixels from the last frame */
+	STAT_CB_FILLED,		/* And from their neighbours */
+	STAT_VRS_INTERPOLATED,	/* Lit from the samples of their tile */
+	STAT_VRS_SHADED,	/* Left out of the samples, lit on their own */
+	STAT_DIRTY_TILES,	/* Redrawn by a partial frame */
+	STAT_CLEAN_TILES,	/* And kept from the last one */
+	STAT_COUNT
+};
+
+/* Stages of the wavefront mode of the naive renderer, and the checkerboard
+ * reconstruction and variable-rate interpolation of the deferred one */
+enum render_stage {
+	STAGE_GENERATE,
+	STAGE_MARCH,
+	STAGE_NORMAL,
+	STAGE_SHADOW,
+	STAGE_SHADE,
+	STAGE_RECONSTRUCT,
+	STAGE_INTERPOLATE,
+	STAGE_COUNT
+};
+
+struct render_stats {
+	SDL_SpinLock	lock;
+	Uint64		count[STAT_COUNT];
+	Uint64		stage_items[STAGE_COUNT];	/* Rays through it */
+	Uint64		stage_time[STAGE_COUNT];	/* Performance ticks */
+};
 
 struct render_data  {
 	SDL_Surface* surf;
 	const struct scene* scene;
+	size_t num_threads;
+	struct render_stats stats;
 	void* private;
 };
 
+/* Threads count on their own and merge into the frame stats once per frame */
+static inline
+void render_stats_merge(struct render_stats* total,
+	const struct render_stats* local) {
+	SDL_AtomicLock(&total->lock);
+	for (size_t i = 0; i < STAT_COUNT; i++)
+		total->count[i] += local->count[i];
+	for (size_t i = 0; i < STAGE_COUNT; i++) {
+		total->stage_items[i] += local->stage_items[i];
+		total->stage_time[i] += local->stage_time[i];
+	}
+	SDL_AtomicUnlock(&total->lock);
+}
+
 static inline Uint32 colorf_to_pixfmt(v3 colorf, const SDL_PixelFormat* fmt) {
 	Uint8 r = colorf.x * 255;
 	Uint8 g = colorf.y * 255;
@@ -23,6 +79,13 @@ static inline Uint32 colorf_to_pixfmt(v3 colorf, const SDL_PixelFormat* fmt) {
 
 int render_thread(void* ptr);
 void render_prepare(struct render_data* scene, int argc, const char* argv[]);
+/* Called from the main thread before the workers start each frame */
+void render_begin_frame(struct render_data* scene);
+/* Whether another frame of the same view would still improve the image */
+bool render_refining(const struct render_data* scene);
+/* Whether it follows edits of the objects and lights, else the edit keys
+ * are off */
+bool render_editable(const struct render_data* scene);
 void render_destroy(struct render_data* scene);
 
 #endif /* __RENDERER_H__ */
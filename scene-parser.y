@@ -41,6 +41,7 @@
 %token	FOV 	        	"fov"
 %token	DIFFUSE_INTENSITY 	"diffuse_intensity"
 %token	SPECULAR_INTENSITY	"specular_intensity"
+%token	SHADOW_SCALE		"shadow_scale"
 %token	RADIUS            	"radius"
 %token	MATERIAL          	"material"
 %token	POINT2            	"point2"
@@ -179,6 +180,7 @@ property:
 |	FOV			{ $$ = PROP_FOV; }
 |	DIFFUSE_INTENSITY	{ $$ = PROP_DIFFUSE_INTENSITY; }
 |	SPECULAR_INTENSITY	{ $$ = PROP_SPECULAR_INTENSITY; }
+|	SHADOW_SCALE		{ $$ = PROP_SHADOW_SCALE; }
 |	RADIUS			{ $$ = PROP_RADIUS; }
 |	MATERIAL		{ $$ = PROP_MATERIAL; }
 |	POINT2			{ $$ = PROP_POINT2; }
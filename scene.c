@@ -28,6 +28,72 @@ struct object* object_dup(const struct object* obj) {
 	return rval;
 }
 
+/* Lipschitz bound of the distance function of an object: the exact
+ * primitives have 1. sminf(a, b, k) interpolates with
+ * h = clamp(.5 + .5 * (b - a) / k), differentiating it the terms coming from
+ * h cancel out (a - b = k * (1 - 2h) inside the blend), leaving
+ * grad = h * grad(a) + (1 - h) * grad(b). So a smooth union is bounded by the
+ * larger bound of its operands, whatever its smoothness. */
+static
+float object_lipschitz(struct object* obj) {
+	switch (obj->type) {
+	case OBJ_SMOOTH_UNION:
+		return obj->lipschitz = fmaxf(
+			object_lipschitz(obj->smooth_op.a),
+			object_lipschitz(obj->smooth_op.b));
+	case OBJ_SPHERE:
+	case OBJ_BOX:
+	case OBJ_PLANE:
+	default:
+		return obj->lipschitz = 1.f;
+	}
+}
+
+struct bounds object_bounds(const struct object* obj) {
+	struct bounds a, b;
+	float dist;
+
+	switch (obj->type) {
+	case OBJ_SPHERE:
+		return (struct bounds) {obj->point, obj->sphere.radius};
+	case OBJ_BOX:
+		return (struct bounds) {
+			obj->point,
+			v3len(obj->box.point2) + obj->box.radius
+		};
+	case OBJ_SMOOTH_UNION:
+		/* sminf(a, b, k) >= min(a, b) - k / 4, so the blend can only
+		 * grow the children bounds by k / 4 */
+		a = object_bounds(obj->smooth_op.a);
+		b = object_bounds(obj->smooth_op.b);
+		dist = v3len(v3sub(b.center, a.center));
+		if (isinf(a.radius) || isinf(b.radius))
+			a.radius = INFINITY;
+		else if (a.radius < dist + b.radius
+		         && b.radius < dist + a.radius) {
+			float radius = (dist + a.radius + b.radius) / 2.f;
+			v3 dir = v3sub(b.center, a.center);
+			a.center = v3add(a.center, v3scale(dir,
+			                 (radius - a.radius) / dist));
+			a.radius = radius;
+		} else if (a.radius < b.radius)
+			a = b;
+		a.radius += fabsf(obj->smooth_op.smoothness) / 4.f;
+		return a;
+	case OBJ_PLANE:
+	default:
+		return (struct bounds) {obj->point, INFINITY};
+	}
+}
+
+bool camera_equal(const struct camera* a, const struct camera* b) {
+	return a->point.x == b->point.x && a->point.y == b->point.y
+	       && a->point.z == b->point.z
+	       && a->direction.x == b->direction.x
+	       && a->direction.y == b->direction.y
+	       && a->direction.z == b->direction.z && a->fov == b->fov;
+}
+
 void definition_free(void* def_ptr) {
 	struct definition* def = def_ptr;
 
@@ -179,6 +245,8 @@ PROPERTY_EXTRACTOR_BEGIN(light)
 		PROP_CASE(POINT,		point);
 		PROP_CASE(DIFFUSE_INTENSITY,	diffuse_intensity);
 		PROP_CASE(SPECULAR_INTENSITY,	specular_intensity);
+		PROP_CASE(SHADOW_SCALE,		shadow_scale);
+		PROP_CASE(RADIUS,		radius);
 	SWITCH_END
 PROPERTY_EXTRACTOR_END
 
@@ -290,3 +358,50 @@ bool scene_validate_materials(const struct scene* scene) {
 
 	return true;
 }
+
+void scene_prepare(struct scene* scene) {
+	vector_foreach(struct object, scene->objects, obj)
+		object_lipschitz(obj);
+}
+
+static
+void object_move(struct object* obj, v3 offset) {
+	obj->point = v3add(obj->point, offset);
+
+	switch (obj->type) {
+	case OBJ_PLANE:
+		obj->plane.y = obj->point.y;
+		break;
+	case OBJ_SMOOTH_UNION:
+		object_move(obj->smooth_op.a, offset);
+		object_move(obj->smooth_op.b, offset);
+		break;
+	}
+}
+
+static
+void scene_changed(struct scene* scene, bool light, size_t index) {
+	scene->generation++;
+	scene->changes[scene->generation % SCENE_CHANGES] =
+		(struct scene_change) {scene->generation, light, index};
+}
+
+void scene_move_object(struct scene* scene, size_t index, v3 offset) {
+	object_move(&vector_get(struct object, scene->objects, index), offset);
+	scene_changed(scene, false, index);
+}
+
+void scene_move_light(struct scene* scene, size_t index, v3 offset) {
+	struct light* light = &vector_get(struct light, scene->lights, index);
+
+	light->point = v3add(light->point, offset);
+	scene_changed(scene, true, index);
+}
+
+const struct scene_change* scene_change_get(const struct scene* scene,
+	unsigned generation) {
+	const struct scene_change* change =
+		&scene->changes[generation % SCENE_CHANGES];
+
+	return generation && change->generation == generation ? change : NULL;
+}
@@ -15,6 +15,7 @@ enum property {
 	PROP_FOV,
 	PROP_DIFFUSE_INTENSITY,
 	PROP_SPECULAR_INTENSITY,
+	PROP_SHADOW_SCALE,
 	PROP_RADIUS,
 	PROP_MATERIAL,
 	PROP_POINT2,
@@ -53,12 +54,15 @@ struct light {
 	v3	point;
 	v3	diffuse_intensity;
 	v3	specular_intensity;
+	float	shadow_scale;	/* Pixels per shadow sample, 0 if unset */
+	float	radius;		/* Of influence, 0 reaches everywhere */
 };
 
 struct object {
 	enum components	type;
 	v3		point;
 	size_t		material;
+	float		lipschitz;	/* Bound of the distance gradient */
 	union {
 		struct {
 			float	radius;
@@ -81,18 +85,38 @@ struct object {
 	};
 };
 
+/* Conservative bounding sphere of an object: whenever its distance function
+ * is <= r the point lies within radius + r of the center. Unbounded objects
+ * (planes and anything built from them) have an infinite radius. */
+struct bounds {
+	v3	center;
+	float	radius;
+};
+
 struct camera {
 	v3	point;
 	v3	direction;
 	float	fov;
 };
 
+/* Edits keep a log of what they touched, for renderers to redraw only that.
+ * It holds the last SCENE_CHANGES, older ones have to redraw everything. */
+#define SCENE_CHANGES 16
+
+struct scene_change {
+	unsigned	generation;	/* The edit bumped it to */
+	bool		light;		/* Or an object */
+	size_t		index;
+};
+
 struct scene {
 	struct vector*	materials;
 	v3		ambient_color;
 	struct vector*	lights;
 	struct vector*	objects;
 	struct camera	camera;
+	unsigned	generation;	/* Bumped on object or light changes */
+	struct scene_change changes[SCENE_CHANGES];	/* By generation */
 };
 
 
@@ -116,9 +140,20 @@ void scene_free(struct scene*);
 void scene_add_component_from_definition_list(struct scene*, int,
 	struct vector*);
 bool scene_validate_materials(const struct scene*);
+void scene_prepare(struct scene*);
+void scene_move_object(struct scene*, size_t index, v3 offset);
+void scene_move_light(struct scene*, size_t index, v3 offset);
+/* The edit that bumped the generation to the given one, NULL if it's no
+ * longer in the log */
+const struct scene_change* scene_change_get(const struct scene*,
+	unsigned generation);
 
 struct object object_from_definition_list(int type, struct vector* props);
 void object_free(void* obj_ptr);
+struct bounds object_bounds(const struct object* obj);
+
+/* Same view, the padding of the vectors aside */
+bool camera_equal(const struct camera* a, const struct camera* b);
 
 struct material material_from_definition_list(struct vector*);
 
@@ -1,9 +1,20 @@
 #ifndef __SDF_H__
 #define __SDF_H__
 
+#include <stdint.h>
+#include <stdio.h>
+
+#include "scene.h"
 #include "vec.h"
+#include "vecx.h"
 #include "float.h"
 
+/* Distance to the closest object and its 1-based index (0 for none) */
+struct world_dist {
+	float dist;
+	uint32_t id;
+};
+
 /* From https://iquilezles.org/www/articles/distfunctions/distfunctions.htm */
 static inline float sdSphere(v3 p, float s) {
 	return v3len(p) - s;
@@ -21,4 +32,118 @@ static inline float sdRoundBox(v3 p, v3 b, float r) {
 	return v3len(clamped_q) + minf(maxf(q.x, maxf(q.y, q.z)), 0.f) - r;
 }
 
+static inline
+float get_obj_dist(const struct object* obj, v3 p) {
+	v3 point = v3sub(p, obj->point);
+	switch (obj->type) {
+		float a_dist, b_dist;
+	case OBJ_SPHERE:
+		return sdSphere(point, obj->sphere.radius);
+	case OBJ_BOX:
+		return sdRoundBox(point, obj->box.point2, obj->box.radius);
+	case OBJ_PLANE:
+		return point.y;
+	case OBJ_SMOOTH_UNION:
+		a_dist = get_obj_dist(obj->smooth_op.a, p);
+		b_dist = get_obj_dist(obj->smooth_op.b, p);
+		return sminf(a_dist, b_dist, obj->smooth_op.smoothness);
+	default:
+		fprintf(stderr, "Unknown scene object\n");
+	}
+}
+
+/* Distance to the object scaled by its Lipschitz bound, so it's always safe to
+ * step that far. Only the objects above 1 pay for the division. */
+static inline
+float get_obj_step(const struct object* obj, v3 p) {
+	float dist = get_obj_dist(obj, p);
+	return obj->lipschitz > 1.f ? dist / obj->lipschitz : dist;
+}
+
+static inline
+struct world_dist sdf(const struct scene* scene, v3 p) {
+	size_t obj_id = 0;
+	float obj_dist = INFINITY;
+	struct world_dist rval = {obj_dist, obj_id};
+
+	vector_foreach(struct object, scene->objects, obj) {
+		obj_dist = get_obj_step(obj, p);
+		obj_id += 1;
+		if (obj_dist < rval.dist)
+			rval = (struct world_dist) {obj_dist, obj_id};
+	}
+
+	return rval;
+}
+
+static __m256 smooth_union_dist8(const struct object* obj, const v3x8* p);
+
+/* get_obj_dist at eight points at once, every operation in the same order as
+ * the scalar version so each lane gives the same result */
+static inline __attribute__((always_inline))
+__m256 get_obj_dist8(const struct object* obj, const v3x8* p) {
+	const __m256 zero = _mm256_setzero_ps();
+	v3x8 point = v3x8sub(*p, v3x8fill(obj->point));
+	__m256 dist;
+	v3x8 q;
+
+	switch (obj->type) {
+	case OBJ_SPHERE:
+		return _mm256_sub_ps(v3x8len(point),
+		                     _mm256_set1_ps(obj->sphere.radius));
+	case OBJ_BOX:
+		q = v3x8sub(v3x8abs(point), v3x8fill(obj->box.point2));
+		dist = _mm256_max_ps(q.x, _mm256_max_ps(q.y, q.z));
+		dist = _mm256_add_ps(v3x8len(v3x8maxf(q, zero)),
+		                     _mm256_min_ps(dist, zero));
+		return _mm256_sub_ps(dist, _mm256_set1_ps(obj->box.radius));
+	case OBJ_PLANE:
+		return point.y;
+	case OBJ_SMOOTH_UNION:
+		return smooth_union_dist8(obj, p);
+	default:
+		fprintf(stderr, "Unknown scene object\n");
+		return _mm256_set1_ps(INFINITY);
+	}
+}
+
+/* Out of line, the only recursive case */
+static
+__m256 smooth_union_dist8(const struct object* obj, const v3x8* p) {
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 half = _mm256_set1_ps(.5f);
+	const __m256 one = _mm256_set1_ps(1.f);
+	__m256 a = get_obj_dist8(obj->smooth_op.a, p);
+	__m256 b = get_obj_dist8(obj->smooth_op.b, p);
+	__m256 k = _mm256_set1_ps(obj->smooth_op.smoothness);
+	__m256 h, dist;
+
+	/* sminf */
+	h = _mm256_div_ps(_mm256_mul_ps(half, _mm256_sub_ps(b, a)), k);
+	h = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(half, h), zero), one);
+	dist = _mm256_add_ps(b, _mm256_mul_ps(_mm256_sub_ps(a, b), h));
+	return _mm256_sub_ps(dist, _mm256_mul_ps(_mm256_mul_ps(k, h),
+	                                         _mm256_sub_ps(one, h)));
+}
+
+static inline
+__m256 get_obj_step8(const struct object* obj, const v3x8* p) {
+	__m256 dist = get_obj_dist8(obj, p);
+
+	if (obj->lipschitz > 1.f)
+		dist = _mm256_div_ps(dist, _mm256_set1_ps(obj->lipschitz));
+	return dist;
+}
+
+/* Distance of sdf (without the index) at eight points */
+static inline
+__m256 sdf8(const struct scene* scene, const v3x8* p) {
+	__m256 rval = _mm256_set1_ps(INFINITY);
+
+	vector_foreach(struct object, scene->objects, obj)
+		rval = _mm256_min_ps(get_obj_step8(obj, p), rval);
+
+	return rval;
+}
+
 #endif /* __SDF_H__ */
@@ -0,0 +1,189 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shadow_cache.h"
+
+/* Slots looked at from the home slot of a cell before giving up */
+#define MAX_PROBES	8
+
+enum slot_state {
+	SLOT_EMPTY,
+	SLOT_WRITING,
+	SLOT_READY
+};
+
+static inline
+size_t cell_hash(uint32_t light, const int32_t cell[3]) {
+	/* Teschner et al., "Optimized Spatial Hashing for Collision Detection
+	 * of Deformable Objects" */
+	return ((uint32_t) cell[0] * 73856093u)
+	       ^ ((uint32_t) cell[1] * 19349663u)
+	       ^ ((uint32_t) cell[2] * 83492791u)
+	       ^ (light * 2654435761u);
+}
+
+static inline
+bool entry_matches(const struct shadow_entry* entry, uint32_t light,
+	const int32_t cell[3]) {
+	return entry->light == light && entry->cell[0] == cell[0]
+	       && entry->cell[1] == cell[1] && entry->cell[2] == cell[2];
+}
+
+/* Copies the entry of the cell to found, false if there's none */
+static
+bool cache_find(const struct shadow_cache* cache, uint32_t light,
+	const int32_t cell[3], struct shadow_entry* found) {
+	size_t home = cell_hash(light, cell);
+
+	for (size_t i = 0; i < MAX_PROBES; i++) {
+		struct shadow_entry* entry =
+			&cache->entries[(home + i) & cache->mask];
+		/* The stamp first, a writer changes it after the state */
+		int stamp = SDL_AtomicGet(&entry->stamp);
+		int state = SDL_AtomicGet(&entry->state);
+
+		if (state == SLOT_EMPTY)
+			return false;
+		if (state != SLOT_READY)
+			continue;
+
+		*found = *entry;
+		/* Replaced while it was being copied */
+		if (SDL_AtomicGet(&entry->state) != SLOT_READY
+		    || SDL_AtomicGet(&entry->stamp) != stamp)
+			continue;
+		if (entry_matches(found, light, cell))
+			return true;
+	}
+
+	return false;
+}
+
+struct shadow_cache* shadow_cache_new(float cell_size, size_t budget) {
+	struct shadow_cache* cache = malloc(sizeof(struct shadow_cache));
+	size_t slots = 1;
+
+	while (slots * 2 * sizeof(struct shadow_entry) <= budget)
+		slots *= 2;
+
+	cache->cell_size = cell_size;
+	cache->mask = slots - 1;
+	cache->frame = 0;
+	cache->entries = calloc(slots, sizeof(struct shadow_entry));
+
+	return cache;
+}
+
+void shadow_cache_free(struct shadow_cache* cache) {
+	if (cache == NULL)
+		return;
+
+	free(cache->entries);
+	free(cache);
+}
+
+void shadow_cache_clear(struct shadow_cache* cache) {
+	memset(cache->entries, 0,
+	       sizeof(struct shadow_entry) * (cache->mask + 1));
+}
+
+void shadow_cache_tick(struct shadow_cache* cache) {
+	cache->frame++;
+}
+
+float shadow_cache_lookup(const struct shadow_cache* cache, uint32_t light,
+	v3 p, v3 n) {
+	/* The samples stand for the center of their cells */
+	v3 rel = v3sub(v3scale(p, 1.f / cache->cell_size), v3fill(.5f));
+	v3 base = {floorf(rel.x), floorf(rel.y), floorf(rel.z)};
+	v3 frac = v3sub(rel, base);
+	float total = 0.f;
+	float weight = 0.f;
+	float lo = 1.f;
+	float hi = 0.f;
+
+	for (int i = 0; i < 8; i++) {
+		int dx = i & 1, dy = i >> 1 & 1, dz = i >> 2;
+		int32_t cell[3] = {base.x + dx, base.y + dy, base.z + dz};
+		struct shadow_entry found;
+		const struct shadow_entry* entry = &found;
+		if (!cache_find(cache, light, cell, &found))
+			continue;
+
+		/* Same surface only, as when upsampling the shadow maps */
+		v3 normal = {entry->normal[0], entry->normal[1],
+		             entry->normal[2]};
+		v3 point = {entry->point[0], entry->point[1], entry->point[2]};
+		float facing = v3dot(n, normal);
+		if (facing <= 0.f
+		    || fabsf(v3dot(n, v3sub(point, p))) > cache->cell_size)
+			continue;
+
+		float w = (dx ? frac.x : 1.f - frac.x)
+		          * (dy ? frac.y : 1.f - frac.y)
+		          * (dz ? frac.z : 1.f - frac.z);
+		facing *= facing;
+		facing *= facing;
+		total += w * facing * entry->shadow;
+		weight += w * facing;
+		lo = minf(lo, entry->shadow);
+		hi = maxf(hi, entry->shadow);
+	}
+
+	if (weight < 1e-3f || hi - lo > SHADOW_EDGE)
+		return -1.f;
+	return total / weight;
+}
+
+void shadow_cache_insert(struct shadow_cache* cache, uint32_t light, v3 p,
+	v3 n, float shadow) {
+	v3 rel = v3scale(p, 1.f / cache->cell_size);
+	int32_t cell[3] = {floorf(rel.x), floorf(rel.y), floorf(rel.z)};
+	size_t home = cell_hash(light, cell);
+	struct shadow_entry* oldest = NULL;
+	uint32_t oldest_age = 0;
+	struct shadow_entry* entry;
+
+	for (size_t i = 0; i < MAX_PROBES; i++) {
+		entry = &cache->entries[(home + i) & cache->mask];
+		int state = SDL_AtomicGet(&entry->state);
+
+		if (state == SLOT_READY && entry_matches(entry, light, cell))
+			return;
+		if (state == SLOT_READY) {
+			/* Unsigned, so it survives the frame wrapping */
+			uint32_t stamp = SDL_AtomicGet(&entry->stamp);
+			uint32_t age = cache->frame - stamp;
+			if (age > oldest_age) {
+				oldest = entry;
+				oldest_age = age;
+			}
+		}
+		if (state != SLOT_EMPTY
+		    || !SDL_AtomicCAS(&entry->state, SLOT_EMPTY, SLOT_WRITING))
+			continue;
+		goto write;
+	}
+
+	/* Full, someone else may be replacing it already */
+	entry = oldest;
+	if (entry == NULL
+	    || !SDL_AtomicCAS(&entry->state, SLOT_READY, SLOT_WRITING))
+		return;
+
+write:
+	SDL_AtomicSet(&entry->stamp, cache->frame);
+	entry->light = light;
+	memcpy(entry->cell, cell, sizeof(entry->cell));
+	entry->shadow = shadow;
+	entry->point[0] = p.x;
+	entry->point[1] = p.y;
+	entry->point[2] = p.z;
+	entry->normal[0] = n.x;
+	entry->normal[1] = n.y;
+	entry->normal[2] = n.z;
+	/* Publish it once everything else is written */
+	SDL_AtomicSet(&entry->state, SLOT_READY);
+}
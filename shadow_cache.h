@@ -0,0 +1,53 @@
+#ifndef __SHADOW_CACHE_H__
+#define __SHADOW_CACHE_H__
+#include <stdint.h>
+#include <SDL.h>
+#include "vec.h"
+
+/* Neighbouring shadow samples further apart than this are an edge */
+#define SHADOW_EDGE .25f
+
+/* Soft shadow factors of each light at the surface points seen so far,
+ * hashed by the world-space cell they fall in. Only valid while the objects
+ * and the lights don't change, then it has to be cleared. Once full, the
+ * entries of the oldest frames make room for the new ones.
+ *
+ * Threads look up and insert concurrently: a slot is claimed with a CAS on
+ * its state and only read once it's marked as ready. Readers check that its
+ * stamp didn't change under them, in case it was replaced meanwhile. */
+struct shadow_entry {
+	SDL_atomic_t	state;		/* Empty, being written or ready */
+	SDL_atomic_t	stamp;		/* Frame it was written in */
+	uint32_t	light;
+	int32_t		cell[3];
+	float		shadow;
+	float		point[3];
+	float		normal[3];
+};
+
+struct shadow_cache {
+	float			cell_size;
+	size_t			mask;		/* Slots - 1, a power of two */
+	uint32_t		frame;		/* Stamp of the new entries */
+	struct shadow_entry*	entries;
+};
+
+/* Takes at most budget bytes */
+struct shadow_cache* shadow_cache_new(float cell_size, size_t budget);
+void shadow_cache_free(struct shadow_cache* cache);
+void shadow_cache_clear(struct shadow_cache* cache);
+/* Starts a new frame, with no threads inside the cache */
+void shadow_cache_tick(struct shadow_cache* cache);
+
+/* Shadow at p (with normal n) interpolated from the samples of the cells
+ * around it on the same surface, negative when they can't tell */
+float shadow_cache_lookup(const struct shadow_cache* cache, uint32_t light,
+	v3 p, v3 n);
+
+/* Keep a shadow traced at p for the cell it falls in. When the neighbourhood
+ * of the cell is full it takes the place of the oldest entry there, or it's
+ * dropped if they are all from this frame. */
+void shadow_cache_insert(struct shadow_cache* cache, uint32_t light, v3 p,
+	v3 n, float shadow);
+
+#endif /* __SHADOW_CACHE_H__ */
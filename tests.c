@@ -0,0 +1,507 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fastmath.h"
+#include "vec.h"
+#include "vecx.h"
+
+/* Unit tests of the SIMD headers against the scalar code and libm they stand
+ * for, and the image comparison of the FAST_MATH renders: make test */
+
+#define ROUNDS 20000
+
+static int checks;
+static int failures;
+
+#define CHECK(cond, format, ...) do { \
+	checks++; \
+	if (!(cond)) { \
+		failures++; \
+		printf("[" __FILE__ ":%d] FAIL " format "\n", \
+		       __LINE__ __VA_OPT__(,) __VA_ARGS__); \
+	} \
+} while (0)
+
+/* xorshift32 with a fixed seed, so a failure repeats */
+static uint32_t state = 0x9E3779B9;
+
+static
+uint32_t random_u32(void) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+/* Uniform in [-range, range) */
+static
+float random_float(float range) {
+	return ((random_u32() >> 8) / (float) (1 << 23) - 1.f) * range;
+}
+
+/* Spread over six orders of magnitude */
+static
+v3 random_v3(void) {
+	float range = powf(10.f, random_float(3.f));
+	return (v3){ random_float(range), random_float(range),
+	             random_float(range) };
+}
+
+static
+bool v3same(v3 a, v3 b) {
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+/* Largest difference of the components, relative to the length of b */
+static
+float v3error(v3 a, v3 b) {
+	v3 d = v3abs(v3sub(a, b));
+	return maxf(d.x, maxf(d.y, d.z)) / v3len(b);
+}
+
+/*
+ * v3x4 and v3x8 lane by lane
+ */
+
+enum lane_op {
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_DOT, OP_LEN, OP_FILL, OP_SCALE,
+	OP_NORMALIZE, OP_ABS, OP_CLAMP, OP_CROSS, OP_MAXF, OP_MINF, OP_MAX,
+	OP_MIN, OP_SELECT, OP_POW, OP_LOAD,
+	LANE_OPS
+};
+
+static const char* lane_op_name[LANE_OPS] = {
+	"add", "sub", "mul", "div", "dot", "len", "fill", "scale",
+	"normalize", "abs", "clamp", "cross", "maxf", "minf", "max",
+	"min", "select", "pow", "load"
+};
+
+/* Inputs of a round, eight lanes worth */
+struct lane_input {
+	v3	a[8];
+	v3	b[8];
+	v3	nan[8];		/* a with some NaN components */
+	float	f[8];
+	float	mask[8];	/* All ones or all zeros */
+	bool	pick[8];	/* Of a, as in the mask */
+};
+
+/* What each operation gave on each lane, floats filled into a v3 */
+typedef v3 lane_output[LANE_OPS][8];
+
+static
+void lane_input_random(struct lane_input* in) {
+	const uint32_t ones = 0xFFFFFFFF;
+	float true_mask;
+
+	memcpy(&true_mask, &ones, sizeof(true_mask));
+	for (int i = 0; i < 8; i++) {
+		in->a[i] = in->nan[i] = random_v3();
+		in->b[i] = random_v3();
+		in->f[i] = random_float(4.f);
+		in->pick[i] = random_u32() & 1;
+		in->mask[i] = in->pick[i] ? true_mask : 0.f;
+		if (random_u32() % 4 == 0)
+			in->nan[i].x = NAN;
+		if (random_u32() % 4 == 0)
+			in->nan[i].z = NAN;
+	}
+}
+
+/* vec.h one lane at a time */
+static
+void lane_scalar(const struct lane_input* in, lane_output out) {
+	for (int i = 0; i < 8; i++) {
+		v3 a = in->a[i], b = in->b[i], nan = in->nan[i];
+		float f = in->f[i];
+
+		out[OP_ADD][i] = v3add(a, b);
+		out[OP_SUB][i] = v3sub(a, b);
+		out[OP_MUL][i] = v3mul(a, b);
+		out[OP_DIV][i] = v3div(a, b);
+		out[OP_DOT][i] = v3fill(v3dot(a, b));
+		out[OP_LEN][i] = v3fill(v3len(a));
+		out[OP_FILL][i] = b;
+		out[OP_SCALE][i] = v3scale(a, f);
+		out[OP_NORMALIZE][i] = v3normalize(a);
+		out[OP_ABS][i] = v3abs(a);
+		out[OP_CLAMP][i] = v3clamp(a, -.5f, 2.f);
+		out[OP_CROSS][i] = v3cross(a, b);
+		out[OP_MAXF][i] = (v3){ maxf(nan.x, f), maxf(nan.y, f),
+		                        maxf(nan.z, f) };
+		out[OP_MINF][i] = (v3){ minf(nan.x, f), minf(nan.y, f),
+		                        minf(nan.z, f) };
+		out[OP_MAX][i] = v3max(a, b);
+		out[OP_MIN][i] = v3min(a, b);
+		out[OP_SELECT][i] = in->pick[i] ? a : b;
+		out[OP_POW][i] = v3pow(v3abs(a), f);
+		out[OP_LOAD][i] = a;
+	}
+}
+
+static
+void lane_v3x4(const struct lane_input* in, lane_output out, int first) {
+	v3x4 a = v3x4load(in->a + first), b = v3x4load(in->b + first);
+	v3x4 nan = v3x4load(in->nan + first);
+	__m128 f = _mm_loadu_ps(in->f + first);
+	__m128 mask = _mm_loadu_ps(in->mask + first);
+	float dot[4], len[4];
+	v3x4 res[LANE_OPS];
+
+	_mm_storeu_ps(dot, v3x4dot(a, b));
+	_mm_storeu_ps(len, v3x4len(a));
+	res[OP_ADD] = v3x4add(a, b);
+	res[OP_SUB] = v3x4sub(a, b);
+	res[OP_MUL] = v3x4mul(a, b);
+	res[OP_DIV] = v3x4div(a, b);
+	res[OP_SCALE] = v3x4scale(a, f);
+	res[OP_NORMALIZE] = v3x4normalize(a);
+	res[OP_ABS] = v3x4abs(a);
+	res[OP_CLAMP] = v3x4clamp(a, -.5f, 2.f);
+	res[OP_CROSS] = v3x4cross(a, b);
+	res[OP_MAXF] = v3x4maxf(nan, f);
+	res[OP_MINF] = v3x4minf(nan, f);
+	res[OP_MAX] = v3x4max(a, b);
+	res[OP_MIN] = v3x4min(a, b);
+	res[OP_SELECT] = v3x4select(mask, a, b);
+	res[OP_LOAD] = a;
+
+	for (int i = 0; i < 4; i++) {
+		for (int op = 0; op < LANE_OPS; op++)
+			if (op != OP_DOT && op != OP_LEN && op != OP_FILL
+			    && op != OP_POW)
+				out[op][first + i] = v3x4lane(res[op], i);
+		out[OP_DOT][first + i] = v3fill(dot[i]);
+		out[OP_LEN][first + i] = v3fill(len[i]);
+		out[OP_FILL][first + i] =
+			v3x4lane(v3x4fill(in->b[first + i]), i);
+		/* One power per call */
+		out[OP_POW][first + i] = v3x4lane(v3x4pow(v3x4abs(a),
+			in->f[first + i]), i);
+	}
+}
+
+static
+void lane_v3x8(const struct lane_input* in, lane_output out) {
+	v3x8 a = v3x8load(in->a, 8), b = v3x8load(in->b, 8);
+	v3x8 nan = v3x8load(in->nan, 8);
+	__m256 f = _mm256_loadu_ps(in->f);
+	__m256 mask = _mm256_loadu_ps(in->mask);
+	float dot[8], len[8];
+	v3x8 res[LANE_OPS];
+
+	_mm256_storeu_ps(dot, v3x8dot(a, b));
+	_mm256_storeu_ps(len, v3x8len(a));
+	res[OP_ADD] = v3x8add(a, b);
+	res[OP_SUB] = v3x8sub(a, b);
+	res[OP_MUL] = v3x8mul(a, b);
+	res[OP_DIV] = v3x8div(a, b);
+	res[OP_SCALE] = v3x8scale(a, f);
+	res[OP_NORMALIZE] = v3x8normalize(a);
+	res[OP_ABS] = v3x8abs(a);
+	res[OP_CLAMP] = v3x8clamp(a, -.5f, 2.f);
+	res[OP_CROSS] = v3x8cross(a, b);
+	res[OP_MAXF] = v3x8maxf(nan, f);
+	res[OP_MINF] = v3x8minf(nan, f);
+	res[OP_MAX] = v3x8max(a, b);
+	res[OP_MIN] = v3x8min(a, b);
+	res[OP_SELECT] = v3x8select(mask, a, b);
+	res[OP_LOAD] = a;
+
+	for (int i = 0; i < 8; i++) {
+		for (int op = 0; op < LANE_OPS; op++)
+			if (op != OP_DOT && op != OP_LEN && op != OP_FILL
+			    && op != OP_POW)
+				out[op][i] = v3x8lane(res[op], i);
+		out[OP_DOT][i] = v3fill(dot[i]);
+		out[OP_LEN][i] = v3fill(len[i]);
+		out[OP_FILL][i] = v3x8lane(v3x8fill(in->b[i]), i);
+		out[OP_POW][i] = v3x8lane(v3x8pow(v3x8abs(a), in->f[i]), i);
+	}
+}
+
+/* Same bits as vec.h, but normalize: with FAST_MATH vec.h's is the rsqrt one
+ * and vecx.h keeps the division */
+static
+void lane_compare(const char* type, const lane_output got,
+	const lane_output want) {
+	for (int op = 0; op < LANE_OPS; op++)
+		for (int i = 0; i < 8; i++) {
+#ifdef FAST_MATH
+			if (op == OP_NORMALIZE) {
+				CHECK(v3error(got[op][i], want[op][i]) < 1e-6f,
+				      "%s%s lane %d", type, lane_op_name[op],
+				      i);
+				continue;
+			}
+#endif
+			CHECK(v3same(got[op][i], want[op][i]),
+			      "%s%s lane %d: %g %g %g, vec.h %g %g %g",
+			      type, lane_op_name[op], i,
+			      got[op][i].x, got[op][i].y, got[op][i].z,
+			      want[op][i].x, want[op][i].y, want[op][i].z);
+		}
+}
+
+static
+void test_lanes(void) {
+	for (int round = 0; round < ROUNDS; round++) {
+		struct lane_input in;
+		lane_output want, got;
+
+		lane_input_random(&in);
+		lane_scalar(&in, want);
+
+		lane_v3x4(&in, got, 0);
+		lane_v3x4(&in, got, 4);
+		lane_compare("v3x4", got, want);
+
+		lane_v3x8(&in, got);
+		lane_compare("v3x8", got, want);
+	}
+}
+
+/* v3x8load fills the lanes past count with the first */
+static
+void test_load_count(void) {
+	v3 v[8];
+
+	for (int i = 0; i < 8; i++)
+		v[i] = random_v3();
+	for (size_t count = 1; count <= 8; count++) {
+		v3x8 l = v3x8load(v, count);
+
+		for (size_t i = 0; i < 8; i++)
+			CHECK(v3same(v3x8lane(l, i), v[i < count ? i : 0]),
+			      "v3x8load count %zu lane %zu", count, i);
+	}
+}
+
+/* v3x8store leaves everything past count untouched */
+static
+void test_store_count(void) {
+	const v3 canary = {-1.f, -2.f, -3.f};
+	v3 v[8];
+
+	for (int i = 0; i < 8; i++)
+		v[i] = random_v3();
+	v3x8 l = v3x8load(v, 8);
+	for (size_t count = 0; count <= 8; count++) {
+		v3 out[9];
+
+		for (size_t i = 0; i < 9; i++)
+			out[i] = canary;
+		v3x8store(out, l, count);
+		for (size_t i = 0; i < 9; i++)
+			CHECK(v3same(out[i], i < count ? v[i] : canary),
+			      "v3x8store count %zu lane %zu", count, i);
+	}
+}
+
+/* Relative to v3normalize, both errors of the length and of the direction */
+static
+void test_normalize_fast(void) {
+	float max_len = 0.f, max_dir = 0.f;
+
+	for (int round = 0; round < ROUNDS; round++) {
+		v3 v[8];
+
+		for (int i = 0; i < 8; i++)
+			v[i] = random_v3();
+		v3x4 n4 = v3x4normalize_fast(v3x4load(v));
+		v3x8 n8 = v3x8normalize_fast(v3x8load(v, 8));
+		for (int i = 0; i < 8; i++) {
+			v3 want = v3normalize(v[i]);
+			v3 got8 = v3x8lane(n8, i);
+
+			if (i < 4) {
+				v3 got4 = v3x4lane(n4, i);
+				max_len = maxf(max_len,
+					fabsf(v3len(got4) - 1.f));
+				max_dir = maxf(max_dir, v3error(got4, want));
+			}
+			max_len = maxf(max_len, fabsf(v3len(got8) - 1.f));
+			max_dir = maxf(max_dir, v3error(got8, want));
+		}
+	}
+
+	printf("normalize_fast: length error %g, against v3normalize %g\n",
+	       max_len, max_dir);
+	CHECK(max_len < 0x1p-21f, "normalize_fast length error %g", max_len);
+	CHECK(max_dir < 0x1p-21f, "normalize_fast error %g", max_dir);
+}
+
+/*
+ * argmin4 and argmin8
+ */
+
+/* First smallest, NaN counting as INFINITY */
+static
+int argmin_scalar(const float* v, int count) {
+	int rval = 0;
+	float min = INFINITY;
+
+	for (int i = 0; i < count; i++)
+		if (v[i] < min) {
+			min = v[i];
+			rval = i;
+		}
+	return rval;
+}
+
+/* Few different values so there are ties, and NaN now and then */
+static
+float random_key(void) {
+	uint32_t r = random_u32() % 16;
+	return r == 15 ? NAN : r == 14 ? INFINITY : (float) (r % 5);
+}
+
+static
+void test_argmin(void) {
+	for (int round = 0; round < ROUNDS; round++) {
+		float v[8];
+
+		for (int i = 0; i < 8; i++)
+			v[i] = random_key();
+		CHECK(argmin4(_mm_loadu_ps(v)) == argmin_scalar(v, 4),
+		      "argmin4 %g %g %g %g gave %d", v[0], v[1], v[2], v[3],
+		      argmin4(_mm_loadu_ps(v)));
+		CHECK(argmin8(_mm256_loadu_ps(v)) == argmin_scalar(v, 8),
+		      "argmin8 gave %d, wanted %d",
+		      argmin8(_mm256_loadu_ps(v)), argmin_scalar(v, 8));
+	}
+
+	/* All NaN */
+	CHECK(argmin4(_mm_set1_ps(NAN)) == 0, "argmin4 of NaN");
+	CHECK(argmin8(_mm256_set1_ps(NAN)) == 0, "argmin8 of NaN");
+}
+
+/*
+ * fastmath.h against libm, in double, over the ranges each comment gives
+ */
+
+static
+float lane0(__m128 v) {
+	return _mm_cvtss_f32(v);
+}
+
+static
+void test_fastmath(void) {
+	double log2_err = 0., exp2_err = 0., pow_err = 0., atan_err = 0.;
+	double rsqrt_err = 0.;
+
+	for (int round = 0; round < ROUNDS * 10; round++) {
+		/* Normal floats, the mantissa and the exponent at random */
+		float x = ldexpf(1.f + (random_u32() >> 9) / (float) (1 << 23),
+		                 (int) (random_u32() % 252) - 125);
+		float e = random_float(126.f);
+		float p = ldexpf(1.f + (random_u32() >> 9) / (float) (1 << 23),
+		                 -(int) (random_u32() % 8) - 1);
+		float y = random_float(8.f);
+		float t = random_float(1000.f) * powf(10.f, random_float(3.f));
+
+		log2_err = fmax(log2_err, fabs(lane0(approx_log2_ps(
+			_mm_set_ss(x))) - log2((double) x)));
+		exp2_err = fmax(exp2_err, fabs(lane0(approx_exp2_ps(
+			_mm_set_ss(e))) / exp2((double) e) - 1.));
+		/* In units of the bound, exp2's error is the floor */
+		pow_err = fmax(pow_err, fabs(lane0(approx_pow_ps(
+			_mm_set_ss(p), _mm_set_ss(y))) / pow(p, y) - 1.)
+			/ (7e-6 * fabs(y) + 2e-7));
+		atan_err = fmax(atan_err, fabs(lane0(approx_atan_ps(
+			_mm_set_ss(t))) - atan((double) t)));
+		rsqrt_err = fmax(rsqrt_err, fabs(lane0(approx_rsqrt_ps(
+			_mm_set_ss(x))) * sqrt((double) x) - 1.));
+	}
+
+	printf("fastmath: log2 %g, exp2 %g, pow %g of the bound, atan %g, "
+	       "rsqrt %g\n", log2_err, exp2_err, pow_err, atan_err,
+	       rsqrt_err);
+	CHECK(log2_err < 1.4e-5, "approx_log2_ps error %g", log2_err);
+	CHECK(exp2_err < 2e-7, "approx_exp2_ps error %g", exp2_err);
+	CHECK(pow_err < 1., "approx_pow_ps error %g of the bound", pow_err);
+	CHECK(atan_err < 2e-6, "approx_atan_ps error %g", atan_err);
+	CHECK(rsqrt_err < 0x1p-21, "approx_rsqrt_ps error %g", rsqrt_err);
+
+	/* Where powf doesn't go through log2 */
+	CHECK(lane0(approx_pow_ps(_mm_set_ss(0.f), _mm_set_ss(0.f))) == 1.f,
+	      "approx_pow_ps(0, 0)");
+	CHECK(lane0(approx_pow_ps(_mm_set_ss(.5f), _mm_set_ss(0.f))) == 1.f,
+	      "approx_pow_ps(.5, 0)");
+	CHECK(lane0(approx_pow_ps(_mm_set_ss(0.f), _mm_set_ss(2.f))) == 0.f,
+	      "approx_pow_ps(0, 2)");
+}
+
+/*
+ * tests psnr a.ppm b.ppm min: whether two renders of the same size, binary
+ * PPMs as from --screenshot, are at least min dB apart
+ */
+
+static
+unsigned char* ppm_read(const char* path, int* width, int* height) {
+	FILE* file = fopen(path, "rb");
+	unsigned char* rval = NULL;
+	int max;
+
+	if (file == NULL) {
+		perror(path);
+		return NULL;
+	}
+	if (fscanf(file, "P6 %d %d %d", width, height, &max) == 3
+	    && max == 255 && fgetc(file) != EOF) {
+		size_t size = (size_t) *width * *height * 3;
+
+		rval = malloc(size);
+		if (rval && fread(rval, 1, size, file) != size) {
+			free(rval);
+			rval = NULL;
+		}
+	}
+	if (rval == NULL)
+		fprintf(stderr, "%s: not a PPM\n", path);
+	fclose(file);
+	return rval;
+}
+
+static
+int psnr(const char* a_path, const char* b_path, double min) {
+	int aw, ah, bw, bh;
+	unsigned char* a = ppm_read(a_path, &aw, &ah);
+	unsigned char* b = ppm_read(b_path, &bw, &bh);
+	double sum = 0., db;
+
+	if (a == NULL || b == NULL || aw != bw || ah != bh) {
+		printf("%s and %s don't compare\n", a_path, b_path);
+		free(a);
+		free(b);
+		return 1;
+	}
+
+	for (size_t i = 0; i < (size_t) aw * ah * 3; i++)
+		sum += (a[i] - b[i]) * (a[i] - b[i]);
+	db = sum ? 10. * log10(255. * 255. * aw * ah * 3 / sum) : INFINITY;
+	printf("%s against %s: %.2f dB, at least %.2f\n", b_path, a_path, db,
+	       min);
+
+	free(a);
+	free(b);
+	return db < min;
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc == 5 && strcmp(argv[1], "psnr") == 0)
+		return psnr(argv[2], argv[3], atof(argv[4]));
+
+	test_lanes();
+	test_load_count();
+	test_store_count();
+	test_normalize_fast();
+	test_argmin();
+	test_fastmath();
+
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures != 0;
+}
@@ -5,6 +5,7 @@
 #include <smmintrin.h>
 #include <xmmintrin.h>
 #include "float.h"
+#include "fastmath.h"
 
 typedef struct v2 {
 	float x;
@@ -55,16 +56,31 @@ static inline v3 v3fill(float v)
 { return (v3){v, v, v}; }
 static inline v3 v3scale(v3 v, float f)
 { return (v3){.vec = _mm_mul_ps(v.vec, _mm_set1_ps(f))}; }
+#ifdef FAST_MATH
+static inline v3 v3normalize(v3 v)
+{ return (v3){.vec = _mm_mul_ps(v.vec, approx_rsqrt_ps(
+                  _mm_dp_ps(v.vec, v.vec, 0x7F)))}; }
+#else
 static inline v3 v3normalize(v3 v)
 { return v3scale(v, 1 / v3len(v)); }
+#endif
 static const int abs_mask = 0x7FFFFFFF;
 static inline v3 v3abs(v3 v)
 { return (v3){.vec = _mm_and_ps(v.vec, _mm_set1_ps(*(const float*)&abs_mask))}; }
 static inline v3 v3clamp(v3 v, float min, float max)
 { return(v3){.vec = _mm_max_ps(_mm_min_ps(v.vec, _mm_set1_ps(max)),
                                _mm_set1_ps(min))}; }
+static inline v3 v3min(v3 a, v3 b)
+{ return (v3){.vec = _mm_min_ps(a.vec, b.vec)}; }
+static inline v3 v3max(v3 a, v3 b)
+{ return (v3){.vec = _mm_max_ps(a.vec, b.vec)}; }
+#ifdef FAST_MATH
+static inline v3 v3pow(v3 v, float pow)
+{ return (v3){.vec = approx_pow_ps(v.vec, _mm_set1_ps(pow))}; }
+#else
 static inline v3 v3pow(v3 v, float pow)
 { return (v3){ powf(v.x, pow), powf(v.y, pow), powf(v.z, pow) }; }
+#endif
 static inline v3 v3cross(v3 a, v3 b)
 { return (v3){ a.y * b.z - a.z * b.y,
                a.z * b.x - a.x * b.z,
@@ -0,0 +1,204 @@
+#ifndef __VECX_H__
+#define __VECX_H__
+
+#include <immintrin.h>
+#include <math.h>
+#include "vec.h"
+
+/* Several v3 side by side (SoA), one per lane: four with SSE and eight with
+ * AVX. The same operations as vec.h, lane by lane and with the same rounding
+ * (dot sums in the order _mm_dp_ps does), so a lane gives what the scalar
+ * version would. Masks are the usual all-ones/all-zeros lanes of a compare.
+ *
+ * The _fast versions don't keep that promise, see each one. */
+
+typedef struct v3x4 {
+	__m128 x;
+	__m128 y;
+	__m128 z;
+} v3x4;
+static inline v3x4 v3x4add(v3x4 a, v3x4 b)
+{ return (v3x4){ _mm_add_ps(a.x, b.x), _mm_add_ps(a.y, b.y),
+                 _mm_add_ps(a.z, b.z) }; }
+static inline v3x4 v3x4sub(v3x4 a, v3x4 b)
+{ return (v3x4){ _mm_sub_ps(a.x, b.x), _mm_sub_ps(a.y, b.y),
+                 _mm_sub_ps(a.z, b.z) }; }
+static inline v3x4 v3x4mul(v3x4 a, v3x4 b)
+{ return (v3x4){ _mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y),
+                 _mm_mul_ps(a.z, b.z) }; }
+static inline v3x4 v3x4div(v3x4 a, v3x4 b)
+{ return (v3x4){ _mm_div_ps(a.x, b.x), _mm_div_ps(a.y, b.y),
+                 _mm_div_ps(a.z, b.z) }; }
+static inline __m128 v3x4dot(v3x4 a, v3x4 b)
+{ return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y)),
+                    _mm_mul_ps(a.z, b.z)); }
+static inline __m128 v3x4len(v3x4 a)
+{ return _mm_sqrt_ps(v3x4dot(a, a)); }
+static inline v3x4 v3x4fill(v3 v)
+{ return (v3x4){ _mm_set1_ps(v.x), _mm_set1_ps(v.y), _mm_set1_ps(v.z) }; }
+static inline v3x4 v3x4scale(v3x4 v, __m128 f)
+{ return (v3x4){ _mm_mul_ps(v.x, f), _mm_mul_ps(v.y, f),
+                 _mm_mul_ps(v.z, f) }; }
+static inline v3x4 v3x4normalize(v3x4 v)
+{ return v3x4scale(v, _mm_div_ps(_mm_set1_ps(1.f), v3x4len(v))); }
+/* rsqrtps and a Newton step, lengths within 2^-21 of 1 */
+static inline v3x4 v3x4normalize_fast(v3x4 v)
+{ __m128 d = v3x4dot(v, v), r = _mm_rsqrt_ps(d);
+  r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(
+          _mm_mul_ps(_mm_set1_ps(.5f), d), _mm_mul_ps(r, r))));
+  return v3x4scale(v, r); }
+static inline v3x4 v3x4abs(v3x4 v)
+{ __m128 m = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  return (v3x4){ _mm_and_ps(v.x, m), _mm_and_ps(v.y, m),
+                 _mm_and_ps(v.z, m) }; }
+static inline v3x4 v3x4clamp(v3x4 v, float min, float max)
+{ __m128 lo = _mm_set1_ps(min), hi = _mm_set1_ps(max);
+  return (v3x4){ _mm_max_ps(_mm_min_ps(v.x, hi), lo),
+                 _mm_max_ps(_mm_min_ps(v.y, hi), lo),
+                 _mm_max_ps(_mm_min_ps(v.z, hi), lo) }; }
+static inline v3x4 v3x4cross(v3x4 a, v3x4 b)
+{ return (v3x4){ _mm_sub_ps(_mm_mul_ps(a.y, b.z), _mm_mul_ps(a.z, b.y)),
+                 _mm_sub_ps(_mm_mul_ps(a.z, b.x), _mm_mul_ps(a.x, b.z)),
+                 _mm_sub_ps(_mm_mul_ps(a.x, b.y), _mm_mul_ps(a.y, b.x)) }; }
+/* Like maxf and minf, NaN lanes in v give f */
+static inline v3x4 v3x4maxf(v3x4 v, __m128 f)
+{ return (v3x4){ _mm_max_ps(v.x, f), _mm_max_ps(v.y, f),
+                 _mm_max_ps(v.z, f) }; }
+static inline v3x4 v3x4minf(v3x4 v, __m128 f)
+{ return (v3x4){ _mm_min_ps(v.x, f), _mm_min_ps(v.y, f),
+                 _mm_min_ps(v.z, f) }; }
+static inline v3x4 v3x4max(v3x4 a, v3x4 b)
+{ return (v3x4){ _mm_max_ps(a.x, b.x), _mm_max_ps(a.y, b.y),
+                 _mm_max_ps(a.z, b.z) }; }
+static inline v3x4 v3x4min(v3x4 a, v3x4 b)
+{ return (v3x4){ _mm_min_ps(a.x, b.x), _mm_min_ps(a.y, b.y),
+                 _mm_min_ps(a.z, b.z) }; }
+/* mask ? a : b */
+static inline v3x4 v3x4select(__m128 mask, v3x4 a, v3x4 b)
+{ return (v3x4){ _mm_blendv_ps(b.x, a.x, mask), _mm_blendv_ps(b.y, a.y, mask),
+                 _mm_blendv_ps(b.z, a.z, mask) }; }
+static inline v3x4 v3x4load(const v3* v)
+{ return (v3x4){ _mm_setr_ps(v[0].x, v[1].x, v[2].x, v[3].x),
+                 _mm_setr_ps(v[0].y, v[1].y, v[2].y, v[3].y),
+                 _mm_setr_ps(v[0].z, v[1].z, v[2].z, v[3].z) }; }
+static inline v3 v3x4lane(v3x4 v, int i)
+{ float x[4], y[4], z[4];
+  _mm_storeu_ps(x, v.x); _mm_storeu_ps(y, v.y); _mm_storeu_ps(z, v.z);
+  return (v3){ x[i], y[i], z[i] }; }
+static inline v3x4 v3x4pow(v3x4 v, float pow)
+{ v3 l[4] = { v3pow(v3x4lane(v, 0), pow), v3pow(v3x4lane(v, 1), pow),
+              v3pow(v3x4lane(v, 2), pow), v3pow(v3x4lane(v, 3), pow) };
+  return v3x4load(l); }
+/* First lane holding the smallest value, NaN lanes count as INFINITY */
+static inline int argmin4(__m128 v)
+{ v = _mm_blendv_ps(v, _mm_set1_ps(INFINITY), _mm_cmpunord_ps(v, v));
+  __m128 m = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+  m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+  return __builtin_ctz(_mm_movemask_ps(_mm_cmpeq_ps(v, m))); }
+
+typedef struct v3x8 {
+	__m256 x;
+	__m256 y;
+	__m256 z;
+} v3x8;
+static inline v3x8 v3x8add(v3x8 a, v3x8 b)
+{ return (v3x8){ _mm256_add_ps(a.x, b.x), _mm256_add_ps(a.y, b.y),
+                 _mm256_add_ps(a.z, b.z) }; }
+static inline v3x8 v3x8sub(v3x8 a, v3x8 b)
+{ return (v3x8){ _mm256_sub_ps(a.x, b.x), _mm256_sub_ps(a.y, b.y),
+                 _mm256_sub_ps(a.z, b.z) }; }
+static inline v3x8 v3x8mul(v3x8 a, v3x8 b)
+{ return (v3x8){ _mm256_mul_ps(a.x, b.x), _mm256_mul_ps(a.y, b.y),
+                 _mm256_mul_ps(a.z, b.z) }; }
+static inline v3x8 v3x8div(v3x8 a, v3x8 b)
+{ return (v3x8){ _mm256_div_ps(a.x, b.x), _mm256_div_ps(a.y, b.y),
+                 _mm256_div_ps(a.z, b.z) }; }
+static inline __m256 v3x8dot(v3x8 a, v3x8 b)
+{ return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a.x, b.x),
+                                     _mm256_mul_ps(a.y, b.y)),
+                       _mm256_mul_ps(a.z, b.z)); }
+static inline __m256 v3x8len(v3x8 a)
+{ return _mm256_sqrt_ps(v3x8dot(a, a)); }
+static inline v3x8 v3x8fill(v3 v)
+{ return (v3x8){ _mm256_set1_ps(v.x), _mm256_set1_ps(v.y),
+                 _mm256_set1_ps(v.z) }; }
+static inline v3x8 v3x8scale(v3x8 v, __m256 f)
+{ return (v3x8){ _mm256_mul_ps(v.x, f), _mm256_mul_ps(v.y, f),
+                 _mm256_mul_ps(v.z, f) }; }
+static inline v3x8 v3x8normalize(v3x8 v)
+{ return v3x8scale(v, _mm256_div_ps(_mm256_set1_ps(1.f), v3x8len(v))); }
+/* rsqrtps and a Newton step, lengths within 2^-21 of 1 */
+static inline v3x8 v3x8normalize_fast(v3x8 v)
+{ __m256 d = v3x8dot(v, v), r = _mm256_rsqrt_ps(d);
+  r = _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(
+          _mm256_mul_ps(_mm256_set1_ps(.5f), d), _mm256_mul_ps(r, r))));
+  return v3x8scale(v, r); }
+static inline v3x8 v3x8abs(v3x8 v)
+{ __m256 m = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+  return (v3x8){ _mm256_and_ps(v.x, m), _mm256_and_ps(v.y, m),
+                 _mm256_and_ps(v.z, m) }; }
+static inline v3x8 v3x8clamp(v3x8 v, float min, float max)
+{ __m256 lo = _mm256_set1_ps(min), hi = _mm256_set1_ps(max);
+  return (v3x8){ _mm256_max_ps(_mm256_min_ps(v.x, hi), lo),
+                 _mm256_max_ps(_mm256_min_ps(v.y, hi), lo),
+                 _mm256_max_ps(_mm256_min_ps(v.z, hi), lo) }; }
+static inline v3x8 v3x8cross(v3x8 a, v3x8 b)
+{ return (v3x8){
+	_mm256_sub_ps(_mm256_mul_ps(a.y, b.z), _mm256_mul_ps(a.z, b.y)),
+	_mm256_sub_ps(_mm256_mul_ps(a.z, b.x), _mm256_mul_ps(a.x, b.z)),
+	_mm256_sub_ps(_mm256_mul_ps(a.x, b.y), _mm256_mul_ps(a.y, b.x)) }; }
+/* Like maxf and minf, NaN lanes in v give f */
+static inline v3x8 v3x8maxf(v3x8 v, __m256 f)
+{ return (v3x8){ _mm256_max_ps(v.x, f), _mm256_max_ps(v.y, f),
+                 _mm256_max_ps(v.z, f) }; }
+static inline v3x8 v3x8minf(v3x8 v, __m256 f)
+{ return (v3x8){ _mm256_min_ps(v.x, f), _mm256_min_ps(v.y, f),
+                 _mm256_min_ps(v.z, f) }; }
+static inline v3x8 v3x8max(v3x8 a, v3x8 b)
+{ return (v3x8){ _mm256_max_ps(a.x, b.x), _mm256_max_ps(a.y, b.y),
+                 _mm256_max_ps(a.z, b.z) }; }
+static inline v3x8 v3x8min(v3x8 a, v3x8 b)
+{ return (v3x8){ _mm256_min_ps(a.x, b.x), _mm256_min_ps(a.y, b.y),
+                 _mm256_min_ps(a.z, b.z) }; }
+/* mask ? a : b */
+static inline v3x8 v3x8select(__m256 mask, v3x8 a, v3x8 b)
+{ return (v3x8){ _mm256_blendv_ps(b.x, a.x, mask),
+                 _mm256_blendv_ps(b.y, a.y, mask),
+                 _mm256_blendv_ps(b.z, a.z, mask) }; }
+/* The first count of v, the rest of the lanes repeat v[0] */
+static inline v3x8 v3x8load(const v3* v, size_t count)
+{ float l[3][8];
+  for (size_t i = 0; i < 8; i++) {
+	size_t j = i < count ? i : 0;
+	l[0][i] = v[j].x; l[1][i] = v[j].y; l[2][i] = v[j].z;
+  }
+  return (v3x8){ _mm256_loadu_ps(l[0]), _mm256_loadu_ps(l[1]),
+                 _mm256_loadu_ps(l[2]) }; }
+/* The other way around, only the first count lanes are written */
+static inline void v3x8store(v3* v, v3x8 a, size_t count)
+{ float l[3][8];
+  _mm256_storeu_ps(l[0], a.x); _mm256_storeu_ps(l[1], a.y);
+  _mm256_storeu_ps(l[2], a.z);
+  for (size_t i = 0; i < count && i < 8; i++)
+	v[i] = (v3){ l[0][i], l[1][i], l[2][i] };
+}
+static inline v3 v3x8lane(v3x8 v, int i)
+{ float x[8], y[8], z[8];
+  _mm256_storeu_ps(x, v.x); _mm256_storeu_ps(y, v.y);
+  _mm256_storeu_ps(z, v.z);
+  return (v3){ x[i], y[i], z[i] }; }
+static inline v3x8 v3x8pow(v3x8 v, float pow)
+{ v3 l[8];
+  for (int i = 0; i < 8; i++)
+	l[i] = v3pow(v3x8lane(v, i), pow);
+  return v3x8load(l, 8); }
+/* First lane holding the smallest value, NaN lanes count as INFINITY */
+static inline int argmin8(__m256 v)
+{ v = _mm256_blendv_ps(v, _mm256_set1_ps(INFINITY),
+                       _mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+  __m256 m = _mm256_min_ps(v, _mm256_permute_ps(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  m = _mm256_min_ps(m, _mm256_permute_ps(m, _MM_SHUFFLE(1, 0, 3, 2)));
+  m = _mm256_min_ps(m, _mm256_permute2f128_ps(m, m, 1));
+  return __builtin_ctz(_mm256_movemask_ps(_mm256_cmp_ps(v, m, _CMP_EQ_OQ))); }
+
+#endif /* __VECX_H__ */